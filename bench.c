@@ -0,0 +1,495 @@
+/* Measures the overhead of libEpollFuzzer itself, per mocked syscall and per exec */
+
+#include "epoll_fuzzer.h"
+
+/* Every allocation is counted, the mock should not allocate once its pools are warm */
+uint64_t bench_allocations;
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *p, size_t size);
+
+void *malloc(size_t size) {
+	bench_allocations++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+	bench_allocations++;
+	return __libc_calloc(count, size);
+}
+
+void *realloc(void *p, size_t size) {
+	bench_allocations++;
+	return __libc_realloc(p, size);
+}
+}
+
+/* What is being measured, started and stopped around the calls of interest only */
+uint64_t bench_ns, bench_started_ns, bench_started_allocations, bench_measured_allocations;
+
+uint64_t bench_clock() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void bench_start() {
+	bench_started_allocations = bench_allocations;
+	bench_started_ns = bench_clock();
+}
+
+void bench_stop() {
+	bench_ns += bench_clock() - bench_started_ns;
+	bench_measured_allocations += bench_allocations - bench_started_allocations;
+}
+
+/* Connections need a listener, which takes one byte of input */
+int bench_listen() {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (listen(fd, 512)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* How many connections the mixes open, the kernel has room for a few more FDs */
+int bench_connections;
+int bench_fds[MAX_FDS];
+
+/* The benchmarks, each runs as test() and returns the number of calls it measured */
+
+int bench_iterations;
+
+uint64_t bench_socket_close() {
+	bench_start();
+	for (int i = 0; i < bench_iterations; i++) {
+		close(socket(AF_INET, SOCK_STREAM, 0));
+	}
+	bench_stop();
+	return 2ull * bench_iterations;
+}
+
+uint64_t bench_epoll_ctl() {
+	int epfd = epoll_create1(0);
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	struct epoll_event event = {};
+	event.events = EPOLLIN;
+
+	bench_start();
+	for (int i = 0; i < bench_iterations; i++) {
+		epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event);
+		epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+	}
+	bench_stop();
+
+	close(fd);
+	close(epfd);
+	return 2ull * bench_iterations;
+}
+
+uint64_t bench_epoll_ctl_mod() {
+	int epfd = epoll_create1(0);
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	struct epoll_event event = {};
+	event.events = EPOLLIN;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event);
+
+	bench_start();
+	for (int i = 0; i < bench_iterations; i++) {
+		event.events = i & 1 ? EPOLLIN : EPOLLIN | EPOLLOUT;
+		epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &event);
+	}
+	bench_stop();
+
+	close(fd);
+	close(epfd);
+	return bench_iterations;
+}
+
+uint64_t bench_timerfd_settime() {
+	int fd = timerfd_create(CLOCK_MONOTONIC, 0);
+	struct itimerspec its = {};
+	its.it_interval.tv_sec = 4;
+
+	bench_start();
+	for (int i = 0; i < bench_iterations; i++) {
+		its.it_value.tv_sec = 1 + i % 8;
+		timerfd_settime(fd, 0, &its, NULL);
+	}
+	bench_stop();
+
+	close(fd);
+	return bench_iterations;
+}
+
+uint64_t bench_eventfd() {
+	int fd = eventfd(0, EFD_NONBLOCK);
+	uint64_t value = 1;
+
+	bench_start();
+	for (int i = 0; i < bench_iterations; i++) {
+		write(fd, &value, 8);
+		read(fd, &value, 8);
+	}
+	bench_stop();
+
+	close(fd);
+	return 2ull * bench_iterations;
+}
+
+/* Sends until the buffer is full, then an epoll_wait drains it with an EPOLLOUT and a scale byte */
+uint64_t bench_send() {
+	int epfd = epoll_create1(0);
+	int lfd = bench_listen();
+	int fd = accept4(lfd, NULL, NULL, 0);
+	struct epoll_event event = {};
+	event.events = EPOLLOUT;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event);
+
+	char buf[64] = {};
+	uint64_t calls = 0;
+	for (int i = 0; i < bench_iterations; i++) {
+		bench_start();
+		for (int j = 0; j < SEND_BUFFER_SIZE / (int) sizeof(buf); j++) {
+			send(fd, buf, sizeof(buf), MSG_NOSIGNAL);
+		}
+		bench_stop();
+		calls += SEND_BUFFER_SIZE / sizeof(buf);
+
+		struct epoll_event events[1];
+		epoll_wait(epfd, events, 1, 0);
+	}
+
+	close(fd);
+	close(lfd);
+	close(epfd);
+	return calls;
+}
+
+/* Accepts and registers a full FD table of connections, which are then closed */
+uint64_t bench_accept_storm() {
+	int epfd = epoll_create1(0);
+	int lfd = bench_listen();
+
+	for (int i = 0; i < bench_iterations; i++) {
+		bench_start();
+		for (int j = 0; j < bench_connections; j++) {
+			bench_fds[j] = accept4(lfd, NULL, NULL, SOCK_NONBLOCK);
+			struct epoll_event event = {};
+			event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+			event.data.fd = bench_fds[j];
+			epoll_ctl(epfd, EPOLL_CTL_ADD, bench_fds[j], &event);
+		}
+		bench_stop();
+
+		for (int j = 0; j < bench_connections; j++) {
+			close(bench_fds[j]);
+		}
+	}
+
+	close(lfd);
+	close(epfd);
+	return 2ull * bench_iterations * bench_connections;
+}
+
+/* Closes a full FD table of registered connections */
+uint64_t bench_close_heavy() {
+	int epfd = epoll_create1(0);
+	int lfd = bench_listen();
+
+	for (int i = 0; i < bench_iterations; i++) {
+		for (int j = 0; j < bench_connections; j++) {
+			bench_fds[j] = accept4(lfd, NULL, NULL, SOCK_NONBLOCK);
+			struct epoll_event event = {};
+			event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+			epoll_ctl(epfd, EPOLL_CTL_ADD, bench_fds[j], &event);
+		}
+
+		bench_start();
+		for (int j = 0; j < bench_connections; j++) {
+			close(bench_fds[j]);
+		}
+		bench_stop();
+	}
+
+	close(lfd);
+	close(epfd);
+	return (uint64_t) bench_iterations * bench_connections;
+}
+
+/* Every epoll_wait scans a full FD table of idle connections, one zero byte each */
+uint64_t bench_epoll_wait_sweep() {
+	int epfd = epoll_create1(0);
+	int lfd = bench_listen();
+
+	for (int j = 0; j < bench_connections; j++) {
+		bench_fds[j] = accept4(lfd, NULL, NULL, SOCK_NONBLOCK);
+		struct epoll_event event = {};
+		event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, bench_fds[j], &event);
+	}
+
+	static struct epoll_event events[1024];
+	bench_start();
+	for (int i = 0; i < bench_iterations; i++) {
+		epoll_wait(epfd, events, 1024, 0);
+	}
+	bench_stop();
+
+	for (int j = 0; j < bench_connections; j++) {
+		close(bench_fds[j]);
+	}
+	close(lfd);
+	close(epfd);
+	return bench_iterations;
+}
+
+/* Every epoll_wait reports a full array of expired timers, out of a full FD table of them */
+uint64_t bench_timer_sweep() {
+	int epfd = epoll_create1(0);
+
+	struct itimerspec its = {};
+	its.it_value.tv_sec = 1;
+	its.it_interval.tv_sec = 1;
+	for (int j = 0; j < bench_connections; j++) {
+		bench_fds[j] = timerfd_create(CLOCK_MONOTONIC, 0);
+		timerfd_settime(bench_fds[j], 0, &its, NULL);
+		struct epoll_event event = {};
+		event.events = EPOLLIN;
+		event.data.fd = bench_fds[j];
+		epoll_ctl(epfd, EPOLL_CTL_ADD, bench_fds[j], &event);
+	}
+
+	static struct epoll_event events[1024];
+	uint64_t calls = 0;
+	bench_start();
+	for (int i = 0; i < bench_iterations; i++) {
+		int n = epoll_wait(epfd, events, 1024, -1);
+		for (int j = 0; j < n; j++) {
+			uint64_t expirations;
+			read(events[j].data.fd, &expirations, 8);
+		}
+		calls += 1 + n;
+	}
+	bench_stop();
+
+	for (int j = 0; j < bench_connections; j++) {
+		close(bench_fds[j]);
+	}
+	close(epfd);
+	return calls;
+}
+
+/* Every epoll_wait queues a full segment of 0xff bytes, which is read in small pieces */
+uint64_t bench_read_heavy() {
+	int epfd = epoll_create1(0);
+	int lfd = bench_listen();
+	int fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK);
+	struct epoll_event event = {};
+	event.events = EPOLLIN;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event);
+
+	uint64_t calls = 0;
+	char buf[64];
+	bench_start();
+	for (int i = 0; i < bench_iterations; i++) {
+		struct epoll_event events[1];
+		epoll_wait(epfd, events, 1, 0);
+		calls++;
+		while (read(fd, buf, sizeof(buf)) > 0) {
+			calls++;
+		}
+		calls++;
+	}
+	bench_stop();
+
+	close(fd);
+	close(lfd);
+	close(epfd);
+	return calls;
+}
+
+struct benchmark {
+	const char *name;
+	uint64_t (*run)();
+	int iterations;
+
+	/* The input is the prefix followed by the pattern repeated, which setup and every iteration
+	 * consume so many bytes of for every connection */
+	const char *prefix;
+	const char *pattern;
+	int pattern_length;
+	int bytes_per_connection;
+	int connections;
+} benchmarks[] = {
+	{"socket + close", bench_socket_close, 1000000, "", "", 0, 0, 1},
+	{"epoll_ctl ADD + DEL", bench_epoll_ctl, 1000000, "", "", 0, 0, 1},
+	{"epoll_ctl MOD", bench_epoll_ctl_mod, 1000000, "", "", 0, 0, 1},
+	{"timerfd_settime", bench_timerfd_settime, 1000000, "", "", 0, 0, 1},
+	{"eventfd write + read", bench_eventfd, 1000000, "", "", 0, 0, 1},
+	{"send 64 bytes", bench_send, 4000, "\x01\x01", "\x04\xff", 2, 2, 1},
+	{"accept storm (accept4 + ADD)", bench_accept_storm, 200, "\x01", "\x01", 1, 1, 990},
+	{"accept storm of 100k", bench_accept_storm, 5, "\x01", "\x01", 1, 1, 100000},
+	{"close-heavy (registered)", bench_close_heavy, 200, "\x01", "\x01", 1, 1, 990},
+	{"close storm of 100k", bench_close_heavy, 5, "\x01", "\x01", 1, 1, 100000},
+	{"epoll_wait sweep of 1k FDs", bench_epoll_wait_sweep, 2000, "\x01", "\x00", 1, 1, 990},
+	{"epoll_wait sweep of 10k FDs", bench_epoll_wait_sweep, 200, "\x01", "\x00", 1, 1, 10000},
+	{"timer sweep of 10k timers", bench_timer_sweep, 2000, "\x01", "", 0, 0, 10000},
+	{"read-heavy (255 byte segments)", bench_read_heavy, 100000, "\x01\x01", "\xff", 1, 257, 1}
+};
+
+/* Runs as test() for every exec */
+uint64_t (*bench_test)();
+uint64_t bench_calls;
+
+/* The end-to-end baseline is an echo server */
+int echo_listen_fd = -1, echo_epfd = -1, echo_registered;
+
+void echo_add(int fd) {
+	struct epoll_event event = {};
+	event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+	event.data.fd = fd;
+	epoll_ctl(echo_epfd, EPOLL_CTL_ADD, fd, &event);
+	echo_registered++;
+}
+
+void echo_drop(int fd) {
+	epoll_ctl(echo_epfd, EPOLL_CTL_DEL, fd, NULL);
+	close(fd);
+	echo_registered--;
+}
+
+uint64_t bench_echo_server() {
+	echo_epfd = epoll_create1(0);
+	echo_listen_fd = bench_listen();
+	echo_registered = 0;
+	if (echo_listen_fd == -1) {
+		close(echo_epfd);
+		return 0;
+	}
+	echo_add(echo_listen_fd);
+
+	int tfd = timerfd_create(CLOCK_MONOTONIC, 0);
+	struct itimerspec its = {};
+	its.it_value.tv_sec = 4;
+	its.it_interval.tv_sec = 4;
+	timerfd_settime(tfd, 0, &its, NULL);
+	echo_add(tfd);
+
+	struct epoll_event events[64];
+	while (echo_registered > 1) {
+		int n = epoll_wait(echo_epfd, events, 64, -1);
+		for (int i = 0; i < n; i++) {
+			int fd = events[i].data.fd;
+			if (fd == echo_listen_fd) {
+				int c;
+				while ((c = accept4(fd, NULL, NULL, SOCK_NONBLOCK)) != -1) {
+					echo_add(c);
+				}
+			} else if (fd == tfd) {
+				uint64_t expirations;
+				read(fd, &expirations, 8);
+			} else if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+				echo_drop(fd);
+			} else if (events[i].events & EPOLLIN) {
+				char buf[512];
+				int length = read(fd, buf, sizeof(buf));
+				if (length == 0) {
+					echo_drop(fd);
+				} else if (length > 0) {
+					send(fd, buf, length, MSG_NOSIGNAL);
+				}
+			}
+		}
+	}
+
+	echo_drop(tfd);
+	close(echo_epfd);
+	return 0;
+}
+
+void test() {
+	bench_calls = bench_test();
+}
+
+void teardown() {
+	if (bench_test != bench_echo_server) {
+		printf("ERROR! Benchmark ran out of input!\n");
+		fuzzer_abort();
+	}
+	echo_drop(echo_listen_fd);
+}
+
+/* The fixed corpus for the end-to-end baseline, the same inputs every run */
+const int CORPUS_INPUTS = 20000;
+const int CORPUS_MAX_LENGTH = 4096;
+
+int main(int argc, char **argv) {
+	const char *filter = argc > 1 ? argv[1] : "";
+
+	printf("%-32s %12s %14s\n", "", "ns/call", "allocs/call");
+	for (unsigned int b = 0; b < sizeof(benchmarks) / sizeof(benchmarks[0]); b++) {
+		struct benchmark *bm = &benchmarks[b];
+		if (!strstr(bm->name, filter)) {
+			continue;
+		}
+
+		int prefix_length = strlen(bm->prefix);
+		/* Setup may take up to one more iteration worth of input */
+		int length = prefix_length + (bm->iterations + 1) * bm->bytes_per_connection * bm->connections;
+		unsigned char *input = (unsigned char *) __libc_malloc(length + 1);
+		memcpy(input, bm->prefix, prefix_length);
+		for (int i = prefix_length; i < length; i++) {
+			input[i] = bm->pattern[(i - prefix_length) % bm->pattern_length];
+		}
+
+		/* The first exec warms up the pools, the second is measured */
+		bench_test = bm->run;
+		bench_iterations = bm->iterations;
+		bench_connections = bm->connections;
+		set_max_fds(bm->connections + 10 > DEFAULT_MAX_FDS ? bm->connections + 10 : DEFAULT_MAX_FDS);
+		for (int warm = 0; warm < 2; warm++) {
+			bench_ns = bench_measured_allocations = 0;
+			LLVMFuzzerTestOneInput(input, length);
+		}
+
+		printf("%-32s %12.1f %14.4f\n", bm->name, (double) bench_ns / bench_calls,
+			(double) bench_measured_allocations / bench_calls);
+		free(input);
+	}
+
+	if (!strstr("end-to-end", filter)) {
+		return 0;
+	}
+
+	/* Random bytes, where every seventh is small so that accept4 succeeds now and then */
+	unsigned char *corpus = (unsigned char *) __libc_malloc((size_t) CORPUS_INPUTS * CORPUS_MAX_LENGTH);
+	int lengths[CORPUS_INPUTS];
+	uint32_t seed = 1234;
+	for (int i = 0; i < CORPUS_INPUTS; i++) {
+		seed = seed * 1103515245 + 12345;
+		lengths[i] = (seed >> 8) % CORPUS_MAX_LENGTH;
+		for (int j = 0; j < lengths[i]; j++) {
+			seed = seed * 1103515245 + 12345;
+			unsigned char byte = seed >> 16;
+			corpus[(size_t) i * CORPUS_MAX_LENGTH + j] = byte % 7 ? byte : byte % 10;
+		}
+	}
+
+	bench_test = bench_echo_server;
+	set_max_fds(DEFAULT_MAX_FDS);
+	uint64_t started_ns = bench_clock(), started_allocations = bench_allocations;
+	for (int i = 0; i < CORPUS_INPUTS; i++) {
+		LLVMFuzzerTestOneInput(corpus + (size_t) i * CORPUS_MAX_LENGTH, lengths[i]);
+	}
+	uint64_t ns = bench_clock() - started_ns;
+
+	printf("end-to-end: %d execs of an echo server in %.1f ms, %.0f execs/sec, %.2f allocs/exec\n", CORPUS_INPUTS,
+		ns / 1e6, CORPUS_INPUTS * 1e9 / ns, (double) (bench_allocations - started_allocations) / CORPUS_INPUTS);
+
+	free(corpus);
+	return 0;
+}
@@ -7,16 +7,52 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdarg.h>
+#include <limits.h>
 //#include <threads.h>
 
 #include <sys/timerfd.h>
+#include <sys/eventfd.h>
 #include <sys/epoll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <linux/io_uring.h>
 #include <netdb.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <signal.h>
+
+#include "epoll_fuzzer_trace.h"
+
+/* Freed mock files are poisoned so that ASan keeps catching use-after-close */
+#if defined(__has_include)
+#if __has_include(<sanitizer/asan_interface.h>)
+#include <sanitizer/asan_interface.h>
+#endif
+#endif
+
+#if defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define FUZZER_ASAN
+#endif
+#endif
+#if defined(__SANITIZE_ADDRESS__) && !defined(FUZZER_ASAN)
+#define FUZZER_ASAN
+#endif
+
+#ifndef ASAN_POISON_MEMORY_REGION
+#define ASAN_POISON_MEMORY_REGION(addr, size) ((void)(addr), (void)(size))
+#define ASAN_UNPOISON_MEMORY_REGION(addr, size) ((void)(addr), (void)(size))
+#endif
 
-// todo: add connect, donät pass invalid-FD to real syscalls
+// todo: add connect (done), donät pass invalid-FD to real syscalls
 // getaddrinfo should return inet6 somtimes and sometimes wrong family (done)
 // accept4 should produce inet6 sometimes (done)
 // socket syscall should fail with given invalid family (done)
@@ -27,8 +63,120 @@
 /* TODO: Our FDs should start at 1024 while actual real FDs should be reserved from 0 to 1023 and passed to actual
  * real syscalls so that we can co-exist with overlapping syscalls like read, open, write, close */
 
+/* Prints every traced syscall as it happens, this is slow */
 //#define PRINTF_DEBUG
 
+/* Records every mocked syscall in a preallocated ring buffer of binary records, which is dumped
+ * to EPOLL_FUZZER_TRACE_FILE (default epoll_fuzzer_trace.bin) when the target crashes, be it
+ * an ASan report, an abort or failed assert, a fault or a libFuzzer timeout.
+ * Build trace_decode to turn a dump into a timeline */
+//#define SYSCALL_TRACE
+
+#if defined(PRINTF_DEBUG) && !defined(SYSCALL_TRACE)
+#define SYSCALL_TRACE
+#endif
+
+/* By default epoll_wait consumes one fuzz byte per registered FD. With sparse readiness it
+ * instead consumes a count byte followed by that many (interest index, event mask) pairs,
+ * so that idle FDs cost neither input bytes nor time. The index takes as many bytes as it
+ * needs to reach every polled FD, and no bytes are consumed while nothing is polled */
+//#define SPARSE_READINESS
+
+/* Audits how well the target batches its syscalls. An input goes over budget when one message
+ * to the peer takes more than MAX_SYSCALLS_PER_MESSAGE syscalls, or when one socket flushes more
+ * than MAX_FLUSHES_PER_ITERATION messages in one event-loop iteration. A message is what leaves
+ * the socket when a write is not held back by MSG_MORE or TCP_CORK. Going over budget is
+ * reported once per input, or aborts with AUDIT_ABORT */
+//#define SYSCALL_AUDIT
+//#define AUDIT_ABORT
+
+#ifndef MAX_SYSCALLS_PER_MESSAGE
+#define MAX_SYSCALLS_PER_MESSAGE 4
+#endif
+
+#ifndef MAX_FLUSHES_PER_ITERATION
+#define MAX_FLUSHES_PER_ITERATION 2
+#endif
+
+/* Times the user space part of every event-loop iteration, from one epoll_wait to the next, on the
+ * monotonic clock. An iteration taking longer than ITERATION_BUDGET_NS plus ITERATION_BUDGET_NS_PER_BYTE
+ * for every byte the target read in it is reported as a crash, along with a histogram of iterations.
+ * This finds quadratic behaviour within one iteration, which never hits the libFuzzer timeout */
+//#define ITERATION_TIMING
+
+#ifndef ITERATION_BUDGET_NS
+#define ITERATION_BUDGET_NS 50000000ull
+#endif
+
+#ifndef ITERATION_BUDGET_NS_PER_BYTE
+#define ITERATION_BUDGET_NS_PER_BYTE 10000ull
+#endif
+
+/* Exports the state of the mock kernel to libFuzzer as extra counters, so that inputs reaching more
+ * open sockets, fuller epoll_wait results, fuller send buffers or more timers count as new coverage.
+ * Most states are bucketed by their power of two */
+//#define KERNEL_COVERAGE
+
+/* Ships a custom mutator and cross-over that know where every syscall took its fuzz data from.
+ * Every executed input leaves a map of its records (epoll_wait iterations, readiness bytes, receive
+ * payloads and single decisions) behind, and inputs are then mutated one whole record at a time,
+ * so that the records after the one mutated stay aligned. Maps are only kept for the inputs run
+ * most recently, others such as corpus units run long ago are mutated as plain bytes */
+//#define STRUCTURED_MUTATOR
+
+/* Runs test() once, up until its first epoll_wait, and snapshots the mock kernel right there.
+ * Every input then resumes the target inside that epoll_wait, and once the input is consumed
+ * all connections it opened are error-closed and the kernel is rolled back to the snapshot.
+ * The target must hand every per-connection resource back when its sockets close.
+ * Only the mock kernel is rolled back: the heap and event loop of the target carry over from
+ * one input to the next, so a crash may need the inputs before it to reproduce. On a crash the
+ * last SNAPSHOT_HISTORY inputs are written to EPOLL_FUZZER_HISTORY_DIR (epoll_fuzzer_history-<pid>),
+ * build replay_snapshot and pass it that directory to resume them in the same order */
+//#define SNAPSHOT_SETUP
+
+/* Builds a load generator instead of a fuzzer. Rather than fuzz data, a scripted workload of N
+ * connections sending pipelined HTTP GETs or WebSocket echo frames drives epoll_wait, accept4 and
+ * the receive queues, and its peers accept and drain whatever they are sent. test() runs once and
+ * requests/sec, ns per request and syscalls per request are printed, all without a network.
+ * A request is done once the target has read all of it and waits again. Only stream sockets are driven */
+//#define LOADGEN_MAIN
+
+/* Puts the target under resource pressure. Every call creating an FD (socket, accept4, eventfd,
+ * timerfd_create, epoll_create1) first consumes a fuzz byte which may fail it with EMFILE, ENFILE,
+ * ENOBUFS or ENOMEM, and sockets fail with ENOBUFS once their buffers would take more than
+ * SOCKET_MEMORY_LIMIT bytes. Set EPOLL_FUZZER_MAX_FDS for a lower FD ceiling. A connection that
+ * could not be accepted stays queued and its listener readable. A target that spends more than
+ * MAX_SPIN_ITERATIONS event-loop iterations in a row doing nothing but failing this way spins
+ * at 100% CPU instead of backing off, which is reported as a crash */
+//#define RESOURCE_PRESSURE
+
+#ifndef SOCKET_MEMORY_LIMIT
+#define SOCKET_MEMORY_LIMIT (16ull << 20)
+#endif
+
+#ifndef MAX_SPIN_ITERATIONS
+#define MAX_SPIN_ITERATIONS 64
+#endif
+
+/* Charges the heap memory the target allocates to the connection it serves at the time, through the
+ * ASan allocator hooks. That is the socket of the first event epoll_wait returned, and from then on
+ * the socket the target last accepted or made a syscall on. The peak heap bytes of every connection
+ * and the bytes closed connections still hold are counted, and a connection holding more than
+ * MAX_CONNECTION_BYTES is reported as a crash. The mock's own allocations are never charged */
+//#define CONNECTION_MEMORY
+
+#ifndef MAX_CONNECTION_BYTES
+#define MAX_CONNECTION_BYTES (1ull << 20)
+#endif
+
+#if defined(CONNECTION_MEMORY) && !defined(FUZZER_ASAN)
+#error CONNECTION_MEMORY needs the ASan allocator, build with -fsanitize=address
+#endif
+
+#if defined(LOADGEN_MAIN) && (defined(SPARSE_READINESS) || defined(SNAPSHOT_SETUP) || defined(REPLAY_MAIN) || defined(RESOURCE_PRESSURE))
+#error LOADGEN_MAIN does not combine with SPARSE_READINESS, SNAPSHOT_SETUP, REPLAY_MAIN or RESOURCE_PRESSURE
+#endif
+
 /* The test case */
 void test();
 void teardown();
@@ -37,715 +185,5201 @@ void teardown();
 extern "C" {
 #endif
 
+struct epoll_file;
+
+/* A file may sit in any number of epoll sets, the first few are kept inline */
+const int INLINE_REGISTRATIONS = 4;
+
+/* An epoll set holding a file, and where in its interest array */
+struct registration {
+	struct epoll_file *ef;
+	int index;
+};
+
 struct file {
 	/* Every file has a type; socket, event, timer, epoll */
 	int type;
 
-	/* We assume there can only be one event-loop at any given point in time,
-	 * so every file holds its own epoll_event */
-	struct epoll_event epev;
+	/* The generation of the FD slot this file was installed in */
+	unsigned int generation;
 
-	/* A file may be added to an epfd by linking it in a list */
-	struct file *prev, *next;
+	/* Every epoll set holding this file. This is the map from FD to interest index, used for O(1) MOD and DEL.
+	 * It points at the inline registrations until the file is added to more sets, and never shrinks while open */
+	int num_registrations, registrations_capacity;
+	struct registration *registrations;
+	struct registration inline_registrations[INLINE_REGISTRATIONS];
+
+	/* The epoll set an EPOLLEXCLUSIVE event went to, which keeps it until its next epoll_wait */
+	struct epoll_file *claim_owner;
+	unsigned int claim_wait;
 };
 
 /* If FD is less than this, it should be passed to REAL syscall.
  * We never produce FDs lower than this (except for -1 on error) */
 const int RESERVED_SYSTEM_FDS = 1024;
 
-/* Map from some collection of integers to a shared extensible struct of data */
-const int MAX_FDS = 1000;
-struct file *fd_to_file[MAX_FDS];
+/* Map from some collection of integers to a shared extensible struct of data.
+ * Every kernel has room for MAX_FDS, but only holds as many open FDs as its capacity,
+ * which is EPOLL_FUZZER_MAX_FDS or DEFAULT_MAX_FDS unless set with set_max_fds */
+const int MAX_FDS = 1 << 20;
+const int DEFAULT_MAX_FDS = 1000;
+
+/* FDs live in a two-level table of pages, which are only allocated once a slot in them is used */
+const int FD_PAGE_SLOTS = 1024;
+const int FD_PAGES = MAX_FDS / FD_PAGE_SLOTS;
+
+struct fd_page {
+	struct file *files[FD_PAGE_SLOTS];
+
+	/* Every slot counts how many times it has been closed, so that holders of a
+	 * file like queued io_uring ops can tell it apart from a later one in the slot */
+	unsigned int generations[FD_PAGE_SLOTS];
+
+	/* The free list runs through the slots */
+	int next_free[FD_PAGE_SLOTS];
+};
 
 const int FD_TYPE_EPOLL = 0;
 const int FD_TYPE_TIMER = 1;
 const int FD_TYPE_EVENT = 2;
 const int FD_TYPE_SOCKET = 3;
+const int FD_TYPE_URING = 4;
+const int FD_TYPE_DATAGRAM = 5;
+const int NUM_FD_TYPES = 6;
 
-int num_fds = 0;
+/* Pools of files */
 
-/* Keeping track of cunsumable data */
-unsigned char *consumable_data;
-int consumable_data_length;
+const int SLAB_OBJECTS_PER_CHUNK = 256;
+const int SLAB_MAX_CHUNKS = MAX_FDS / SLAB_OBJECTS_PER_CHUNK + 1;
 
-void set_consumable_data(const unsigned char *new_data, int new_length) {
-	consumable_data = (unsigned char *) new_data;
-	consumable_data_length = new_length;
-}
+struct slab_pool {
+	/* Set on first allocation */
+	size_t object_size;
 
-/* Returns non-null on error */
-int consume_byte(unsigned char *b) {
-	if (consumable_data_length) {
-		*b = consumable_data[0];
-		consumable_data++;
-		consumable_data_length--;
-		return 0;
-	}
-	return -1;
-}
+	unsigned char *chunks[SLAB_MAX_CHUNKS];
+	int num_chunks;
 
-/* Keeping track of FDs */
+	/* Objects below this index have been handed out at least once during this input */
+	int carved;
 
-/* Returns -1 on error, or RESERVED_SYSTEM_FDS and above */
-int allocate_fd() {
-	// this can be massively optimized by having a list of free blocks or the like
-	for (int fd = 0; fd < MAX_FDS; fd++) {
-		if (!fd_to_file[fd]) {
-			num_fds++;
-			return fd + RESERVED_SYSTEM_FDS;
-		}
-	}
-	return -1;
-}
+	/* Freed objects are recycled in FIFO order, linked through their first word */
+	void *free_head, *free_tail;
+};
 
-/* This one should set the actual file for this FD */
-void init_fd(int fd, int type, struct file *f) {
-	if (fd >= RESERVED_SYSTEM_FDS) {
-		fd_to_file[fd - RESERVED_SYSTEM_FDS] = f;
-		fd_to_file[fd - RESERVED_SYSTEM_FDS]->type = type;
-		fd_to_file[fd - RESERVED_SYSTEM_FDS]->next = NULL;
-		fd_to_file[fd - RESERVED_SYSTEM_FDS]->prev = NULL;
-	}
-}
+#ifdef SYSCALL_TRACE
+/* Must be a power of two */
+#ifndef TRACE_RECORDS
+#define TRACE_RECORDS 16384
+#endif
+#endif
 
-struct file *map_fd(int fd) {
-	if (fd >= RESERVED_SYSTEM_FDS && fd < MAX_FDS + RESERVED_SYSTEM_FDS) {
-		return fd_to_file[fd - RESERVED_SYSTEM_FDS];
-	}
-	return NULL;
-}
+struct timer_file;
+struct socket_file;
+struct epoll_interest;
+
+#ifdef STRUCTURED_MUTATOR
+/* The fuzz data an input spent on one thing */
+const int RECORD_WAIT = 0;
+const int RECORD_READY = 1;
+const int RECORD_RECEIVE = 2;
+const int RECORD_DECISION = 3;
+
+struct record {
+	int kind;
+	int offset;
+	int length;
+};
 
-/* This one should remove the FD from any pollset by calling epoll_ctl remove */
-int free_fd(int fd) {
-	if (fd >= RESERVED_SYSTEM_FDS && fd < MAX_FDS + RESERVED_SYSTEM_FDS) {
-		if (fd_to_file[fd - RESERVED_SYSTEM_FDS]) {
-			fd_to_file[fd - RESERVED_SYSTEM_FDS] = 0;
-			num_fds--;
-			return 0;
-		}
-	}
+/* Records beyond this are not kept, the tail of such input is mutated as plain bytes */
+const int MAX_RECORDS = 4096;
+#endif
 
-	return -1;
-}
+#ifdef SNAPSHOT_SETUP
+#include <ucontext.h>
+#include <sys/stat.h>
 
-/* The epoll syscalls */
+/* The target keeps its own state from one input to the next, so a crash may depend on the inputs
+ * before it. This many of the last inputs are kept to be written out when the target crashes */
+const int SNAPSHOT_HISTORY = 256;
 
-struct epoll_file {
-	struct file base;
+struct snapshot_input {
+	unsigned char *data;
+	size_t size, capacity;
+};
 
-	/* A doubly linked list for polls awaiting events */
-	struct file *poll_set_head, *poll_set_tail;
+/* An open file as raw bytes, with its registrations and the interest set if it is an epoll file */
+struct snapshot_file {
+	int slot;
+	size_t size;
+	unsigned char *bytes;
+	struct registration *registrations;
+	struct epoll_interest *interest;
 };
 
-/* This function is O(n) and does not consume any fuzz data, but will fail if run out of FDs */
-int __wrap_epoll_create1(int flags) {
+/* The mock kernel as it was at the first epoll_wait */
+struct kernel_snapshot {
+	int taken;
 
-	/* Todo: check that we do not allocate more than one epoll FD */
-	int fd = allocate_fd();
+	int num_fds, num_sockets;
+	int fd_watermark;
+	int free_slots_head, free_slots_tail, free_slots_count;
 
-	if (fd != -1) {
-		struct epoll_file *ef = (struct epoll_file *)malloc(sizeof(struct epoll_file));
+	/* Of the slots below the watermark */
+	unsigned int *fd_generation;
+	int *next_free;
+	int pool_carved[NUM_FD_TYPES];
 
-		/* Init the epoll_file */
-		ef->poll_set_head = NULL;
-		ef->poll_set_tail = NULL;
+	uint64_t virtual_clock;
+	int timer_heap_size, num_pending_timers;
+	struct timer_file **timer_heap;
+	struct timer_file **pending_timers;
 
-		init_fd(fd, FD_TYPE_EPOLL, (struct file *)ef);
-	}
+	int num_readable_sockets;
+	struct socket_file **readable_sockets;
 
-#ifdef PRINTF_DEBUG
-	printf("epoll_create1 returning epfd: %d\n", fd);
+	int num_files;
+	struct snapshot_file *files;
+};
 #endif
 
-	return fd;
-}
+/* How the target reads sockets */
+struct read_stats {
+	/* Segments of fuzz data queued on sockets, and their bytes */
+	uint64_t segments, bytes_queued;
 
-// this function cannot be called inside an iteration! it changes the list
-/* This function is O(1) and does not consume any fuzz data */
-int __wrap_epoll_ctl(int epfd, int op, int fd, struct epoll_event *event) {
+	/* Reads of sockets, those that found the queue empty, and bytes read */
+	uint64_t reads, empty_reads, bytes_read;
 
-	struct epoll_file *ef = (struct epoll_file *)map_fd(epfd);
-	if (!ef) {
-		return -1;
-	}
+	/* Times a socket was reported readable */
+	uint64_t readable_reports;
 
-	struct file *f = (struct file *)map_fd(fd);
-	if (!f) {
-		return -1;
-	}
+	/* Calls to epoll_wait, those made while sockets still had queued data, and those sockets */
+	uint64_t waits, undrained_waits, undrained_sockets;
+};
 
-	/* We add new polls in the head */
-	if (op == EPOLL_CTL_ADD) {
-		// if there is a head already
-		if (ef->poll_set_head) {
-			ef->poll_set_head->prev = f;
+#ifdef CONNECTION_MEMORY
+/* What connections allocate, accumulated over all inputs */
+struct memory_stats {
+	/* Connections that allocated anything, the sum of their peak heap bytes and the largest peak */
+	uint64_t connections, peak_bytes;
+	size_t max_peak_bytes;
 
-			// then it will be our next
-			f->next = ef->poll_set_head;
-		} else {
-			// if there was no head then we became the tail also
-			ef->poll_set_tail = f;
-		}
+	/* Inputs that left closed connections holding more heap bytes than they started with */
+	uint64_t holding_inputs;
+};
 
-		// we are now the head in any case
-		ef->poll_set_head = f;
+/* A live allocation charged to the connection open on fd with the given id */
+struct allocation {
+	const volatile void *p;
+	size_t size;
+	int fd;
+	uint64_t connection;
+};
+#endif
 
-		f->epev = *event;
+/* How the target fills send buffers */
+struct send_stats {
+	/* Sends, those that only wrote some of their bytes, those that wrote nothing, and bytes written */
+	uint64_t sends, partial_sends, full_sends, bytes_sent;
 
-	} else if (op == EPOLL_CTL_MOD) {
-		/* Modifying is simply changing the file itself */
-		f->epev = *event;
-	} else if (op == EPOLL_CTL_DEL) {
+	/* Times the peer acknowledged data */
+	uint64_t drains;
 
-		if (f->prev) {
-			f->prev->next = f->next;
-		} else {
-			ef->poll_set_head = f->next;
-		}
+	/* The most bytes ever buffered on one socket */
+	int peak_buffered;
 
-		if (f->next) {
-			f->next->prev = f->prev;
-		} else {
-			// tail ska vara vår.prev
-			ef->poll_set_tail = f->prev;
-		}
+	/* Messages flushed to peers, and by how many syscalls */
+	uint64_t messages, message_syscalls;
 
-		// a file that is not in the list should be reset to NULL
-		f->prev = NULL;
-		f->next = NULL;
-	}
+	/* Event-loop iterations that sent anything, and the most sends in one of them */
+	uint64_t sending_iterations;
+	int max_iteration_sends;
 
-	/* You have to poll for errors and hangups */
-	f->epev.events |= EPOLLERR | EPOLLHUP;
+	/* Messages that went over the syscall audit budgets */
+	uint64_t over_budget;
+};
 
-	return 0;
-}
+/* All state of the mock kernel. Every thread runs against the kernel it has bound,
+ * so that a few event loops can be fuzzed side by side in one process */
+struct mock_kernel {
+	/* The FDs of this kernel start at RESERVED_SYSTEM_FDS + fd_offset */
+	int fd_offset;
 
-/* This function is O(n) and consumes fuzz data and might trigger teardown callback */
-int __wrap_epoll_wait(int epfd, struct epoll_event *events,
-               int maxevents, int timeout) {
-	//printf("epoll_wait: %d\n", 0);
+	/* How many FDs may be open at once, 0 until the first FD is allocated */
+	int max_fds;
 
-#ifdef PRINTF_DEBUG
-	printf("Calling epoll_wait\n");
-#endif
+	struct fd_page *fd_pages[FD_PAGES];
 
-	struct epoll_file *ef = (struct epoll_file *)map_fd(epfd);
-	if (!ef) {
-		return -1;
-	}
+	/* Slots below this have been handed out at least once during this input */
+	int fd_watermark;
 
-	if (consumable_data_length) {
+	/* Closed slots are recycled in FIFO order, and only once we have run out of
+	 * fresh slots. This keeps a closed FD number unused for as long as possible,
+	 * so that a use-after-close most likely hits an empty slot and fails with EBADF */
+	int free_slots_head;
+	int free_slots_tail;
+	int free_slots_count;
 
-		int ready_events = 0;
+	int num_fds, num_sockets;
 
-		for (struct file *f = ef->poll_set_head; f; f = f->next) {
+	/* FDs opened and closed, over all inputs */
+	uint64_t fd_changes;
 
+	/* Keeping track of cunsumable data */
+	unsigned char *consumable_data;
+	int consumable_data_length;
 
-			/* Consume one fuzz byte, AND it with the event */
-			if (!consumable_data_length) {
-				// break if we have no data
-				break;
-			}
+	/* The whole input, for knowing how far we are into it */
+	const unsigned char *consumable_data_start;
+	int consumable_data_total;
 
-			// here we have the main condition that drives everything
-			int ready_event = consumable_data[0] & f->epev.events;
+#ifdef SYSCALL_TRACE
+	struct trace_record trace_ring[TRACE_RECORDS];
+	uint64_t trace_count;
+#endif
 
-			// consume the byte
-			consumable_data_length--;
-			consumable_data++;
+	struct slab_pool epoll_pool, socket_pool, timer_pool, event_pool, uring_pool, datagram_pool;
 
-			if (ready_event) {
-				if (ready_events < maxevents) {
-					events[ready_events] = f->epev;
-
-					// todo: the event should be masked by the byte, not everything it wants shold be given all the time!
-					events[ready_events++].events = ready_event;
-				} else {
-					// we are full, break
-					break;
-				}
-			}
+	/* The interest array of the last closed epoll_file is kept for the next one */
+	struct epoll_interest *spare_interest;
+	int spare_interest_capacity;
 
-		}
+	/* Time only passes in epoll_wait. When fuzz data makes nothing ready, a blocking
+	 * epoll_wait sleeps until the next timer expires, or until its own timeout */
+	uint64_t virtual_clock;
 
-		return ready_events;
+	/* Armed timers in a min-heap on expiration. This and the arrays below hold max_fds entries */
+	struct timer_file **timer_heap;
+	int timer_heap_size;
 
-	} else {
+	/* Timers with unread expirations, these are readable */
+	struct timer_file **pending_timers;
+	int num_pending_timers;
 
-#ifdef PRINTF_DEBUG
-		printf("Calling teardown\n");
-#endif
-		teardown();
+	/* Sockets with queued data or EOF, these are readable */
+	struct socket_file **readable_sockets;
+	int num_readable_sockets;
 
-		// after shutting down the listen socket we clear the whole list (the bug in epoll_ctl remove)
-		// so the below loop doesn't work - we never close anything more than the listen socket!
+	/* Open io_uring files, so that munmap only has to look at their rings */
+	struct uring_file *urings;
 
-		/* You don't really need to emit teardown, you could simply emit error on every poll */
+	/* How the target reads, accumulated over all inputs */
+	struct read_stats read_stats;
 
-		int ready_events = 0;
+	/* How the target sends, accumulated over all inputs */
+	struct send_stats send_stats;
 
-#ifdef PRINTF_DEBUG
-		printf("Emitting error on every remaining FD\n");
-#endif
-		for (struct file *f = ef->poll_set_head; f; f = f->next) {
+	/* Every epoll_wait starts a new event-loop iteration */
+	unsigned int iteration;
+	int iteration_sends;
 
-			if (f->type == FD_TYPE_SOCKET) {
+	/* Going over an audit budget is reported once per input */
+	int over_budget_reported;
 
-				if (ready_events < maxevents) {
-					events[ready_events] = f->epev;
+	/* Teardown runs once per input, at whichever epoll_wait first finds the data consumed */
+	int torn_down;
 
-					// todo: the event should be masked by the byte, not everything it wants shold be given all the time!
-					events[ready_events++].events = EPOLLERR | EPOLLHUP;
-				} else {
-					// we are full, break
-					break;
-				}
+	/* SIGALRM ticks during this input. libFuzzer ticks every half -timeout and kills a slow input on a tick */
+	int alarms;
 
-			}
-		}
+#ifdef ITERATION_TIMING
+	/* When the current iteration started, 0 before the first epoll_wait of an input */
+	uint64_t iteration_started;
+	uint64_t iteration_bytes_read;
 
-#ifdef PRINTF_DEBUG
-		printf("Ready events: %d\n", ready_events);
+	/* Iterations by the power of two of their nanoseconds */
+	uint64_t iteration_histogram[64];
+
+	/* How long the last iteration took */
+	uint64_t iteration_ns;
 #endif
 
-		return ready_events;
-	}
-}
+#ifdef RESOURCE_PRESSURE
+	/* Calls that failed for lack of FDs or memory in the current iteration, and the bytes read,
+	 * bytes sent and FD changes when it started */
+	int iteration_pressure_errors;
+	uint64_t iteration_progress;
 
-/* The socket syscalls */
+	/* Iterations in a row which did nothing but fail for lack of FDs or memory, and their time */
+	int spin_iterations;
+#ifdef ITERATION_TIMING
+	uint64_t spin_ns;
+#endif
+#endif
 
-struct socket_file {
-	struct file base;
+#ifdef CONNECTION_MEMORY
+	/* The connection allocations are charged to, -1 for none */
+	int memory_owner;
+	uint64_t memory_owner_connection;
 
-	/* We store socket addresses created in accept4 */
-	union {
-		struct sockaddr_in6 in6;
-		struct sockaddr_in in;
-	} addr;
+	/* Every socket gets an id, which is never reused */
+	uint64_t next_connection;
 
-	/* The size of sockaddr_in6 or sockaddr_in as a whole */
-	socklen_t len;
-};
+	/* Allocations by the mock itself are not charged */
+	int mock_allocating;
 
-extern int __real_read(int fd, void *buf, size_t count);
-int __wrap_read(int fd, void *buf, size_t count) {
+	/* Live charged allocations, in an open-addressing table mapped outside of the heap */
+	struct allocation *allocations;
+	int allocations_capacity, num_allocations;
 
-	if (fd < RESERVED_SYSTEM_FDS) {
-		return __real_read(fd, buf, count);
-	}
+	/* Heap bytes charged to connections that have since closed, and at the start of the input */
+	size_t closed_bytes, input_closed_bytes;
 
-#ifdef PRINTF_DEBUG
-	printf("Wrapped read\n");
+	struct memory_stats memory_stats;
 #endif
 
-	/* Let's try and clear the buffer first */
-	//memset(buf, 0, count);
+#ifdef STRUCTURED_MUTATOR
+	/* Records of the current input, in the order they were consumed */
+	struct record records[MAX_RECORDS];
+	int num_records;
+#endif
 
-	struct file *f = map_fd(fd);
-	if (!f) {
-		return -1;
-	}
+	/* Returned by getaddrinfo, with the address it points to */
+	struct addrinfo addrinfo_result;
+	union {
+		struct sockaddr_in6 in6;
+		struct sockaddr_in in;
+	} addrinfo_address;
 
-	errno = 0;
+#ifdef SNAPSHOT_SETUP
+	/* The target runs on its own stack so that it can be parked inside epoll_wait */
+	ucontext_t fuzzer_context, target_context;
+	void *target_stack;
+	int target_running;
 
-	if (f->type == FD_TYPE_SOCKET) {
+	/* ASan needs to know the bounds of the stack we switch back to */
+	const void *fuzzer_stack;
+	size_t fuzzer_stack_size;
 
-		if (!consumable_data_length) {
-			errno = EWOULDBLOCK;
-			return -1;
-		} else {
-			int data_available = (unsigned char) consumable_data[0];
-			consumable_data_length--;
-			consumable_data++;
+	struct kernel_snapshot snapshot;
 
-			if (consumable_data_length < data_available) {
-				data_available = consumable_data_length;
-			}
+	/* Is the slot open with the same file as when we took the snapshot? Open slots never move */
+	char *snapshot_open;
 
-			if (count < data_available) {
-				data_available = count;
-			}
+	/* The inputs resumed since the target was started, a ring of the last SNAPSHOT_HISTORY */
+	struct snapshot_input history[SNAPSHOT_HISTORY];
+	uint64_t history_count;
+#endif
+};
 
-			memcpy(buf, consumable_data, data_available);
+/* Threads start out bound to the default kernel, which is what LLVMFuzzerTestOneInput uses */
+struct mock_kernel default_kernel;
+thread_local struct mock_kernel *kernel = &default_kernel;
 
-			consumable_data_length -= data_available;
-			consumable_data += data_available;
+#ifdef CONNECTION_MEMORY
+/* The allocator hooks are global, but only threads running inputs charge memory */
+thread_local int charging_memory = 0;
+#endif
 
-			return data_available;
-		}
-	}
+void set_consumable_data(const unsigned char *new_data, int new_length) {
+	kernel->consumable_data = (unsigned char *) new_data;
+	kernel->consumable_data_length = new_length;
+	kernel->consumable_data_start = new_data;
+	kernel->consumable_data_total = new_length;
+}
 
-	if (f->type == FD_TYPE_EVENT) {
-		memset(buf, 1, 8);
-		return 8;
-	}
+/* How far we are into the input */
+int input_offset() {
+	return kernel->consumable_data_total - kernel->consumable_data_length;
+}
 
-	if (f->type == FD_TYPE_TIMER) {
-		memset(buf, 1, 8);
-		return 8;
+/* Returns non-null on error */
+int consume_byte(unsigned char *b) {
+#ifdef LOADGEN_MAIN
+	/* The workload makes the decisions that matter, the rest take 0xff so that listen and
+	 * getaddrinfo succeed and peers drain everything at once */
+	*b = 0xff;
+	return 0;
+#endif
+	if (kernel->consumable_data_length) {
+		*b = kernel->consumable_data[0];
+		kernel->consumable_data++;
+		kernel->consumable_data_length--;
+		return 0;
 	}
-
 	return -1;
 }
 
-/* We just ignore the extra flag here */
-int __wrap_recv(int sockfd, void *buf, size_t len, int flags) {
-	return __wrap_read(sockfd, buf, len);
-}
+/* Tracing syscalls */
 
-int __wrap_send(int sockfd, const void *buf, size_t len, int flags) {
+#ifdef LOADGEN_MAIN
+/* Syscalls made by the target, readiness, receives and other pseudo events are not syscalls */
+uint64_t loadgen_syscalls;
 
-	if (consumable_data_length) {
-		/* We can send len scaled by the 1 byte */
-		unsigned char scale = consumable_data[0];
-		consumable_data++;
-		consumable_data_length--;
+int count_syscall(int syscall, int ret) {
+	switch (syscall) {
+	case TRACE_INPUT: case TRACE_EPOLL_EVENT: case TRACE_TEARDOWN: case TRACE_RECEIVE: case TRACE_DRAIN:
+	case TRACE_MESSAGE: case TRACE_COMPLETION: case TRACE_DATAGRAMS: case TRACE_CONNECTED:
+		break;
+	default:
+		loadgen_syscalls++;
+	}
+	return ret;
+}
+#endif
 
-		int written = float(scale) / 255.0f * len;
+#ifdef SYSCALL_TRACE
+/* Records a syscall and passes its return value through, errno is left untouched */
+int trace_syscall(int syscall, int fd, int64_t arg0, int64_t arg1, int ret) {
+#ifdef LOADGEN_MAIN
+	count_syscall(syscall, ret);
+#endif
+	struct trace_record *r = &kernel->trace_ring[kernel->trace_count++ & (TRACE_RECORDS - 1)];
+	r->offset = kernel->consumable_data_total - kernel->consumable_data_length;
+	r->syscall = syscall;
+	r->error = ret < 0 ? errno : 0;
+	r->fd = fd;
+	r->ret = ret;
+	r->args[0] = arg0;
+	r->args[1] = arg1;
 
-		if (written == 0) {
-			errno = EWOULDBLOCK;
-		} else {
-			errno = 0;
-		}
+#ifdef PRINTF_DEBUG
+	print_trace_record(stdout, r);
+#endif
 
-		return written;
-	} else {
-		return -1;
-	}
+	return ret;
 }
 
-int __wrap_sendto(int sockfd, const void *buf, size_t len, int flags,
-	const struct sockaddr *dest_addr, socklen_t addrlen) {
-		return __wrap_send(sockfd, buf, len, flags);
-}
+/* Writes the ring buffer and the current input to the trace file, using nothing but write */
+void dump_trace() {
+	const char *path = getenv("EPOLL_FUZZER_TRACE_FILE");
+	int fd = open(path ? path : "epoll_fuzzer_trace.bin", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		return;
+	}
 
-int __wrap_bind() {
-	return 0;
-}
+	uint64_t first = kernel->trace_count > TRACE_RECORDS ? kernel->trace_count - TRACE_RECORDS : 0;
+	struct trace_header header = {{'E', 'F', 'T', 'R'}, TRACE_VERSION, (uint32_t) (kernel->trace_count - first), (uint32_t) first, (uint32_t) kernel->consumable_data_total};
 
-int __wrap_setsockopt() {
-	return 0;
-}
+	ssize_t ignored = write(fd, &header, sizeof(header));
 
-extern int __real_fcntl(int fd, int cmd, ... /* arg */ );
-int __wrap_fcntl(int fd, int cmd, ... /* arg */) {
-	if (fd < RESERVED_SYSTEM_FDS) {
-		va_list args;
-		va_start(args, cmd);
-		int ret = __real_fcntl(fd, cmd, args);
-		va_end(args);
-		return ret;
+	/* The ring wraps around, so the oldest records may come after the newest */
+	uint64_t begin = first & (TRACE_RECORDS - 1), end = kernel->trace_count & (TRACE_RECORDS - 1);
+	if (begin < end || !header.num_records) {
+		ignored = write(fd, &kernel->trace_ring[begin], (end - begin) * sizeof(struct trace_record));
+	} else {
+		ignored = write(fd, &kernel->trace_ring[begin], (TRACE_RECORDS - begin) * sizeof(struct trace_record));
+		ignored = write(fd, &kernel->trace_ring[0], end * sizeof(struct trace_record));
 	}
+	ignored = write(fd, kernel->consumable_data_start, kernel->consumable_data_total);
+	(void) ignored;
 
-	return 0;
+	close(fd);
 }
 
-/* Addrinfo */
-int __wrap_getaddrinfo(const char *node, const char *service,
-                       const struct addrinfo *hints,
-                       struct addrinfo **res) {
-	//printf("Wrapped getaddrinfo\n");
+/* Starts a new input in the trace */
+void trace_input() {
+	trace_syscall(TRACE_INPUT, -1, kernel->consumable_data_total, 0, 0);
+}
 
-	struct addrinfo default_hints = {};
+#define TRACE(syscall, fd, arg0, arg1, ret) trace_syscall(syscall, fd, (int64_t) (arg0), (int64_t) (arg1), ret)
+#elif defined(LOADGEN_MAIN)
+#define TRACE(syscall, fd, arg0, arg1, ret) count_syscall(syscall, ret)
+#else
+#define TRACE(syscall, fd, arg0, arg1, ret) (ret)
+#endif
 
-	if (!hints) {
-		hints = &default_hints;
-	}
+/* Records of the input */
 
-	unsigned char b;
-	if (consume_byte(&b)) {
-		return -1;
+#ifdef STRUCTURED_MUTATOR
+/* Records what the input spent since offset start, an epoll_wait iteration is recorded before it spends anything */
+void record(int kind, int start) {
+	if (kernel->num_records < MAX_RECORDS) {
+		struct record *r = &kernel->records[kernel->num_records++];
+		r->kind = kind;
+		r->offset = start;
+		r->length = input_offset() - start;
 	}
+}
 
-	/* This one should be thread_local */
-	static /*thread_local*/ struct addrinfo ai;
-	ai.ai_flags = hints->ai_flags;
-	ai.ai_socktype = hints->ai_socktype;
-	ai.ai_protocol = hints->ai_protocol;
+#define RECORD(kind, start) record(kind, start)
+#else
+#define RECORD(kind, start) ((void) (start))
+#endif
 
-	if (b > 127) {
-		ai.ai_family = AF_INET;//hints->ai_family;
-	} else {
-		ai.ai_family = AF_INET6;//hints->ai_family;
-	}
+/* Coverage of kernel states */
+
+#ifdef KERNEL_COVERAGE
+const int COVER_OPEN_SOCKETS = 0;
+const int COVER_READY_EVENTS = 1;
+const int COVER_INTEREST = 2;
+const int COVER_BACKPRESSURE = 3;
+const int COVER_READABLE_SOCKETS = 4;
+const int COVER_ARMED_TIMERS = 5;
+const int COVER_PENDING_TIMERS = 6;
+const int COVER_QUEUED_DATAGRAMS = 7;
+const int COVER_MESSAGE_BATCH = 8;
+
+/* Every state has 16 buckets. libFuzzer clears these before every input */
+__attribute__((used, section("__libfuzzer_extra_counters"))) uint8_t kernel_coverage[9 * 16];
+
+/* Buckets 0, 1, 2-3, 4-7 and so on */
+int log2_bucket(uint64_t value) {
+	int bucket = value ? 64 - __builtin_clzll(value) : 0;
+	return bucket < 15 ? bucket : 15;
+}
 
-	/* This one is for generating the wrong family (maybe invalid?) */
-	if (b == 0) {
-		ai.ai_family = hints->ai_family;
-	}
+#define COVER(state, bucket) (kernel_coverage[(state) * 16 + (bucket)] = 1)
+#else
+#define COVER(state, bucket) ((void) 0)
+#endif
 
-	ai.ai_next = NULL;
-	ai.ai_canonname = NULL; // fel
+/* Reporting bugs */
 
-	// these should depend on inet6 or inet */
-	ai.ai_addrlen = 4; // fel
-	ai.ai_addr = NULL; // ska peka på en sockaddr!
+#ifdef REPLAY_MAIN
+void replay_report();
+void replay_step(int epfd, int num_interest);
+#endif
 
-	// we need to return an addrinfo with family AF_INET6
+#if defined(SNAPSHOT_SETUP) && !defined(REPLAY_MAIN)
+void dump_input_history();
+#endif
+
+#ifdef LOADGEN_MAIN
+/* The workload standing in for fuzz data, see the load generator */
+struct socket_file;
+struct epoll_interest;
+int loadgen_iteration();
+int loadgen_events(struct epoll_interest *ei);
+int loadgen_connecting();
+void loadgen_open(struct socket_file *sf);
+int loadgen_segment(struct socket_file *sf, const unsigned char **data);
+void loadgen_close(struct socket_file *sf);
+#endif
+
+#ifdef CONNECTION_MEMORY
+/* Charging heap memory to connections, see the socket syscalls */
+extern "C" int __sanitizer_install_malloc_and_free_hooks(void (*malloc_hook)(const volatile void *, size_t), void (*free_hook)(const volatile void *));
+struct file;
+void charge_memory_to(int fd, struct file *f);
+void charge_malloc(const volatile void *p, size_t size);
+void charge_free(const volatile void *p);
+#endif
+
+/* Everything we know about the input is written out before the process dies */
+void write_crash_report() {
+#ifdef SYSCALL_TRACE
+	dump_trace();
+#endif
+#ifdef REPLAY_MAIN
+	replay_report();
+#endif
+#if defined(SNAPSHOT_SETUP) && !defined(REPLAY_MAIN)
+	dump_input_history();
+#endif
+}
+
+/* Reports once, a crash may reach us both through a signal and through ASan */
+void report_crash() {
+	static int reported = 0;
+	if (!__atomic_exchange_n(&reported, 1, __ATOMIC_RELAXED)) {
+		write_crash_report();
+	}
+}
+
+#ifdef FUZZER_ASAN
+void report_crash_on_asan_report(const char *report) {
+	report_crash();
+}
+#endif
+
+/* Aborts, failed asserts, faults and timeouts do not go through ASan, so we sit on top of whatever
+ * libFuzzer and ASan handle these signals with, report, and hand the signal on to them.
+ * Exits for -rss_limit_mb and -malloc_limit_mb cannot be caught */
+const int CRASH_SIGNALS[] = {SIGABRT, SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGALRM};
+struct sigaction crash_handlers[NSIG];
+
+void report_crash_on_signal(int sig, siginfo_t *info, void *context) {
+	if (sig != SIGALRM) {
+		report_crash();
+	} else if (kernel->alarms++) {
+		/* Any tick after the first may be the one that kills this input, the report is rewritten until then */
+		write_crash_report();
+	}
+
+	struct sigaction *handler = &crash_handlers[sig];
+	if (handler->sa_flags & SA_SIGINFO) {
+		handler->sa_sigaction(sig, info, context);
+	} else if (handler->sa_handler == SIG_DFL) {
+		sigaction(sig, handler, NULL);
+		raise(sig);
+	} else if (handler->sa_handler != SIG_IGN) {
+		handler->sa_handler(sig);
+	}
+}
+
+void hook_crash_signals() {
+	struct sigaction action = {};
+	action.sa_sigaction = report_crash_on_signal;
+	action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+	sigemptyset(&action.sa_mask);
+	for (unsigned int i = 0; i < sizeof(CRASH_SIGNALS) / sizeof(CRASH_SIGNALS[0]); i++) {
+		sigaction(CRASH_SIGNALS[i], &action, &crash_handlers[CRASH_SIGNALS[i]]);
+	}
+}
+
+/* Starts a new input, hooking crash signals and ASan reports the first time */
+void begin_input(const unsigned char *data, int length) {
+	set_consumable_data(data, length);
+#ifdef STRUCTURED_MUTATOR
+	kernel->num_records = 0;
+#endif
+	kernel->over_budget_reported = 0;
+	kernel->torn_down = 0;
+	kernel->alarms = 0;
+#ifdef ITERATION_TIMING
+	kernel->iteration_started = 0;
+	kernel->iteration_ns = 0;
+#endif
+#ifdef RESOURCE_PRESSURE
+	kernel->iteration_pressure_errors = 0;
+	kernel->spin_iterations = 0;
+#endif
+#if defined(RESOURCE_PRESSURE) && defined(ITERATION_TIMING)
+	kernel->spin_ns = 0;
+#endif
+
+	static int hooked = 0;
+	if (!__atomic_exchange_n(&hooked, 1, __ATOMIC_RELAXED)) {
+		hook_crash_signals();
+#ifdef FUZZER_ASAN
+		__asan_set_error_report_callback(report_crash_on_asan_report);
+#ifdef CONNECTION_MEMORY
+		__sanitizer_install_malloc_and_free_hooks(charge_malloc, charge_free);
+#endif
+#endif
+	}
+
+#ifdef CONNECTION_MEMORY
+	charging_memory = 1;
+	kernel->memory_owner = -1;
+	kernel->input_closed_bytes = kernel->closed_bytes;
+#endif
+
+#ifdef SYSCALL_TRACE
+	trace_input();
+#endif
+}
+
+/* Aborts on bugs found in the target */
+void fuzzer_abort() {
+	report_crash();
+
+	/* Our report would be lost in the buffer when stdout is a pipe */
+	fflush(stdout);
+	abort();
+}
+
+/* Keeping track of FDs */
+
+/* Resets FD numbering so that every input sees the same sequence of FDs.
+ * Only valid when no FD is open */
+void reset_fds() {
+	for (int page = 0; page * FD_PAGE_SLOTS < kernel->fd_watermark; page++) {
+		memset(kernel->fd_pages[page]->generations, 0, sizeof(kernel->fd_pages[page]->generations));
+	}
+	kernel->fd_watermark = 0;
+	kernel->free_slots_count = 0;
+}
+
+/* Where the file of a slot below the watermark is kept */
+struct file **slot_file(int slot) {
+	return &kernel->fd_pages[slot / FD_PAGE_SLOTS]->files[slot % FD_PAGE_SLOTS];
+}
+
+unsigned int *slot_generation(int slot) {
+	return &kernel->fd_pages[slot / FD_PAGE_SLOTS]->generations[slot % FD_PAGE_SLOTS];
+}
+
+/* The mock allocates for itself in between these, which is not charged to any connection */
+void begin_mock_allocation() {
+#ifdef CONNECTION_MEMORY
+	kernel->mock_allocating++;
+#endif
+}
+
+void end_mock_allocation() {
+#ifdef CONNECTION_MEMORY
+	kernel->mock_allocating--;
+#endif
+}
+
+/* Reads EPOLL_FUZZER_MAX_FDS once */
+int default_max_fds() {
+	static int max_fds = 0;
+	if (!max_fds) {
+		const char *value = getenv("EPOLL_FUZZER_MAX_FDS");
+		int parsed = value ? atoi(value) : 0;
+		max_fds = parsed > 0 && parsed <= MAX_FDS ? parsed : DEFAULT_MAX_FDS;
+	}
+	return max_fds;
+}
+
+/* Sets how many FDs the kernel of the calling thread can have open at once, up to MAX_FDS.
+ * Only valid when no FD is open. Returns non-null on error */
+int set_max_fds(int max_fds) {
+	if (max_fds < 1 || max_fds > MAX_FDS || kernel->num_fds) {
+		return -1;
+	}
+
+	/* Every FD may be a timer or a readable socket */
+	begin_mock_allocation();
+	struct timer_file **timer_heap = (struct timer_file **) realloc(kernel->timer_heap, max_fds * sizeof(struct timer_file *));
+	struct timer_file **pending_timers = (struct timer_file **) realloc(kernel->pending_timers, max_fds * sizeof(struct timer_file *));
+	struct socket_file **readable_sockets = (struct socket_file **) realloc(kernel->readable_sockets, max_fds * sizeof(struct socket_file *));
+	end_mock_allocation();
+	if (timer_heap) {
+		kernel->timer_heap = timer_heap;
+	}
+	if (pending_timers) {
+		kernel->pending_timers = pending_timers;
+	}
+	if (readable_sockets) {
+		kernel->readable_sockets = readable_sockets;
+	}
+	if (!timer_heap || !pending_timers || !readable_sockets) {
+		return -1;
+	}
+
+	kernel->max_fds = max_fds;
+	return 0;
+}
+
+/* Every mock kernel hands out FDs from its own range, starting at or above RESERVED_SYSTEM_FDS */
+int fd_base() {
+	return RESERVED_SYSTEM_FDS + kernel->fd_offset;
+}
+
+/* Returns the slot of an FD in the range of this kernel, or -1 */
+int fd_slot(int fd) {
+	int slot = fd - fd_base();
+	return (fd >= RESERVED_SYSTEM_FDS && slot >= 0 && slot < MAX_FDS) ? slot : -1;
+}
+
+/* Fails a call for lack of FDs or memory, returns -1 */
+int out_of_resources(int error) {
+#ifdef RESOURCE_PRESSURE
+	kernel->iteration_pressure_errors++;
+#endif
+	errno = error;
+	return -1;
+}
+
+/* Returns -1 with errno set on error, or an FD in the range of this kernel. This function is O(1) */
+int allocate_fd() {
+	if (!kernel->max_fds && set_max_fds(default_max_fds())) {
+		return out_of_resources(ENOMEM);
+	}
+
+	int slot;
+	if (kernel->fd_watermark < kernel->max_fds) {
+		/* Pages are kept for later inputs */
+		struct fd_page **page = &kernel->fd_pages[kernel->fd_watermark / FD_PAGE_SLOTS];
+		if (!*page) {
+			begin_mock_allocation();
+			*page = (struct fd_page *) calloc(1, sizeof(struct fd_page));
+			end_mock_allocation();
+			if (!*page) {
+				return out_of_resources(ENOMEM);
+			}
+		}
+		slot = kernel->fd_watermark++;
+	} else if (kernel->free_slots_count) {
+		slot = kernel->free_slots_head;
+		kernel->free_slots_head = kernel->fd_pages[slot / FD_PAGE_SLOTS]->next_free[slot % FD_PAGE_SLOTS];
+		kernel->free_slots_count--;
+	} else {
+		return out_of_resources(EMFILE);
+	}
+
+	kernel->num_fds++;
+	kernel->fd_changes++;
+	return slot + fd_base();
+}
+
+#ifdef RESOURCE_PRESSURE
+/* What fuzz data fails a call with, sockets aside ENOBUFS is ENOMEM */
+const int PRESSURE_ERRORS[] = {EMFILE, ENFILE, ENOBUFS, ENOMEM};
+
+/* Every socket takes a send and a receive buffer, like the defaults of net.ipv4.tcp_wmem and tcp_rmem */
+const int SOCKET_MEMORY = 2 * 16384;
+#endif
+
+/* Allocates the FD of a new file, or of a new socket which also takes buffer memory.
+ * Under RESOURCE_PRESSURE this consumes one byte, which may fail it. Returns -1 with errno set on error */
+int create_fd(int is_socket) {
+#ifdef RESOURCE_PRESSURE
+	if (is_socket && (uint64_t) (kernel->num_sockets + 1) * SOCKET_MEMORY > SOCKET_MEMORY_LIMIT) {
+		return out_of_resources(ENOBUFS);
+	}
+
+	unsigned char b;
+	if (!consume_byte(&b)) {
+		RECORD(RECORD_DECISION, input_offset() - 1);
+		if (b < sizeof(PRESSURE_ERRORS) / sizeof(PRESSURE_ERRORS[0])) {
+			return out_of_resources(!is_socket && PRESSURE_ERRORS[b] == ENOBUFS ? ENOMEM : PRESSURE_ERRORS[b]);
+		}
+	}
+#endif
+	return allocate_fd();
+}
+
+/* This one should set the actual file for this FD */
+void init_fd(int fd, int type, struct file *f) {
+	int slot = fd_slot(fd);
+	if (slot != -1) {
+		*slot_file(slot) = f;
+		f->type = type;
+		f->generation = *slot_generation(slot);
+		f->num_registrations = 0;
+		f->registrations_capacity = INLINE_REGISTRATIONS;
+		f->registrations = f->inline_registrations;
+		f->claim_owner = NULL;
+	}
+}
+
+/* Called with the FD and how many times its slot has been closed whenever the target uses a closed FD,
+ * before the call fails with EBADF. Closed slots are reused last, so most stale uses hit a closed slot,
+ * but a stale FD whose slot has been reused names the new file and goes unnoticed */
+void (*closed_fd_hook)(int fd, unsigned int closes) = NULL;
+
+/* Set closed_fd_hook to this to abort on the first use of a closed FD */
+void report_closed_fd(int fd, unsigned int closes) {
+	printf("ERROR! Use of closed FD %d (closed %u times)\n", fd, closes);
+	fuzzer_abort();
+}
+
+/* The file an FD refers to, or NULL if it is closed, without reporting it */
+struct file *lookup_fd(int fd) {
+	int slot = fd_slot(fd);
+	return (slot != -1 && slot < kernel->fd_watermark) ? *slot_file(slot) : NULL;
+}
+
+/* The file an FD refers to, or NULL with errno set to EBADF */
+struct file *map_fd(int fd) {
+	int slot = fd_slot(fd);
+	if (slot != -1 && slot < kernel->fd_watermark) {
+		struct file *f = *slot_file(slot);
+		if (!f) {
+			if (closed_fd_hook) {
+				closed_fd_hook(fd, *slot_generation(slot));
+			}
+			errno = EBADF;
+			return NULL;
+		}
+#ifdef CONNECTION_MEMORY
+		/* The target now serves whatever socket it makes a syscall on */
+		charge_memory_to(fd, f);
+#endif
+		return f;
+	}
+	errno = EBADF;
+	return NULL;
+}
+
+/* Queues a slot for reuse and gives up its FD */
+void release_slot(int slot) {
+	if (kernel->free_slots_count++) {
+		kernel->fd_pages[kernel->free_slots_tail / FD_PAGE_SLOTS]->next_free[kernel->free_slots_tail % FD_PAGE_SLOTS] = slot;
+	} else {
+		kernel->free_slots_head = slot;
+	}
+	kernel->free_slots_tail = slot;
+
+	kernel->num_fds--;
+	kernel->fd_changes++;
+}
+
+/* This one should remove the FD from any pollset by calling epoll_ctl remove */
+int free_fd(int fd) {
+	int slot = fd_slot(fd);
+	if (slot != -1 && slot < kernel->fd_watermark) {
+		if (*slot_file(slot)) {
+			*slot_file(slot) = 0;
+			(*slot_generation(slot))++;
+			release_slot(slot);
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/* Allocation of files */
+
+/* Files are carved from type-segregated slabs that are never returned to the heap,
+ * so that once warmed up, an input does not allocate any heap memory for mock files.
+ * Slabs are reset in bulk at the end of every input */
+void *slab_alloc(struct slab_pool *pool, size_t size) {
+	void *p;
+
+	/* Rounded up to keep every object aligned for ASan poisoning */
+	if (!pool->object_size) {
+		pool->object_size = (size + 15) & ~(size_t) 15;
+	}
+
+	/* Prefer carving fresh objects from chunks we already have, so that freed objects stay poisoned for longer */
+	int chunk = pool->carved / SLAB_OBJECTS_PER_CHUNK;
+	if (pool->free_head && chunk == pool->num_chunks) {
+		p = pool->free_head;
+		ASAN_UNPOISON_MEMORY_REGION(p, pool->object_size);
+		pool->free_head = *(void **) p;
+		if (!pool->free_head) {
+			pool->free_tail = NULL;
+		}
+		return p;
+	}
+
+	if (chunk == SLAB_MAX_CHUNKS) {
+		return NULL;
+	}
+
+	if (chunk == pool->num_chunks) {
+		begin_mock_allocation();
+		pool->chunks[chunk] = (unsigned char *) malloc(pool->object_size * SLAB_OBJECTS_PER_CHUNK);
+		end_mock_allocation();
+		if (!pool->chunks[chunk]) {
+			return NULL;
+		}
+		ASAN_POISON_MEMORY_REGION(pool->chunks[chunk], pool->object_size * SLAB_OBJECTS_PER_CHUNK);
+		pool->num_chunks++;
+	}
+
+	p = pool->chunks[chunk] + (pool->carved % SLAB_OBJECTS_PER_CHUNK) * pool->object_size;
+	pool->carved++;
+	ASAN_UNPOISON_MEMORY_REGION(p, pool->object_size);
+	return p;
+}
+
+void slab_free(struct slab_pool *pool, void *p) {
+	*(void **) p = NULL;
+	if (pool->free_tail) {
+		ASAN_UNPOISON_MEMORY_REGION(pool->free_tail, sizeof(void *));
+		*(void **) pool->free_tail = p;
+		ASAN_POISON_MEMORY_REGION(pool->free_tail, pool->object_size);
+	} else {
+		pool->free_head = p;
+	}
+	pool->free_tail = p;
+	ASAN_POISON_MEMORY_REGION(p, pool->object_size);
+}
+
+/* Allocates the file of an FD from create_fd, or returns NULL if there is no FD. If there is no memory
+ * for the file either, the FD is given back and set to -1 with errno set to ENOMEM */
+void *alloc_file(int *fd, struct slab_pool *pool, size_t size) {
+	if (*fd == -1) {
+		return NULL;
+	}
+
+	void *p = slab_alloc(pool, size);
+	if (!p) {
+		release_slot(fd_slot(*fd));
+		*fd = out_of_resources(ENOMEM);
+	}
+	return p;
+}
+
+/* Releases every object at once, this function is O(chunks touched during the input) */
+void slab_reset(struct slab_pool *pool) {
+	int touched = (pool->carved + SLAB_OBJECTS_PER_CHUNK - 1) / SLAB_OBJECTS_PER_CHUNK;
+	for (int i = 0; i < touched; i++) {
+		ASAN_POISON_MEMORY_REGION(pool->chunks[i], pool->object_size * SLAB_OBJECTS_PER_CHUNK);
+	}
+	pool->carved = 0;
+	pool->free_head = NULL;
+	pool->free_tail = NULL;
+}
+
+/* The virtual clock */
+
+uint64_t timespec_to_ns(const struct timespec *ts) {
+	return ts->tv_sec * 1000000000ull + ts->tv_nsec;
+}
+
+struct timespec ns_to_timespec(uint64_t ns) {
+	struct timespec ts;
+	ts.tv_sec = ns / 1000000000ull;
+	ts.tv_nsec = ns % 1000000000ull;
+	return ts;
+}
+
+struct timer_file {
+	struct file base;
+
+	/* Absolute time of the next expiration in ns, and the period if periodic */
+	uint64_t expiration;
+	uint64_t interval;
+
+	/* Expirations not yet read */
+	uint64_t expirations;
+
+	/* Where in the timer heap and in the pending list we are, or -1 */
+	int heap_index;
+	int pending_index;
+};
+
+void timer_heap_swap(int a, int b) {
+	struct timer_file *t = kernel->timer_heap[a];
+	kernel->timer_heap[a] = kernel->timer_heap[b];
+	kernel->timer_heap[b] = t;
+	kernel->timer_heap[a]->heap_index = a;
+	kernel->timer_heap[b]->heap_index = b;
+}
+
+void timer_heap_sift(int i) {
+	while (i && kernel->timer_heap[i]->expiration < kernel->timer_heap[(i - 1) / 2]->expiration) {
+		timer_heap_swap(i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+
+	while (1) {
+		int smallest = i, left = 2 * i + 1, right = 2 * i + 2;
+		if (left < kernel->timer_heap_size && kernel->timer_heap[left]->expiration < kernel->timer_heap[smallest]->expiration) {
+			smallest = left;
+		}
+		if (right < kernel->timer_heap_size && kernel->timer_heap[right]->expiration < kernel->timer_heap[smallest]->expiration) {
+			smallest = right;
+		}
+		if (smallest == i) {
+			break;
+		}
+		timer_heap_swap(i, smallest);
+		i = smallest;
+	}
+}
+
+void arm_timer(struct timer_file *tf, uint64_t expiration, uint64_t interval) {
+	tf->expiration = expiration;
+	tf->interval = interval;
+	if (tf->heap_index == -1) {
+		tf->heap_index = kernel->timer_heap_size;
+		kernel->timer_heap[kernel->timer_heap_size++] = tf;
+		COVER(COVER_ARMED_TIMERS, log2_bucket(kernel->timer_heap_size));
+	}
+	timer_heap_sift(tf->heap_index);
+}
+
+void disarm_timer(struct timer_file *tf) {
+	if (tf->heap_index != -1) {
+		int i = tf->heap_index;
+		timer_heap_swap(i, --kernel->timer_heap_size);
+		if (i < kernel->timer_heap_size) {
+			timer_heap_sift(i);
+		}
+		tf->heap_index = -1;
+	}
+}
+
+void clear_expirations(struct timer_file *tf) {
+	if (tf->pending_index != -1) {
+		kernel->pending_timers[tf->pending_index] = kernel->pending_timers[--kernel->num_pending_timers];
+		kernel->pending_timers[tf->pending_index]->pending_index = tf->pending_index;
+		tf->pending_index = -1;
+	}
+	tf->expirations = 0;
+}
+
+/* See the epoll syscalls */
+void signal_edge(struct file *f, int events);
+
+/* Moves every timer due by now from the heap to the pending list */
+void expire_timers() {
+	while (kernel->timer_heap_size && kernel->timer_heap[0]->expiration <= kernel->virtual_clock) {
+		struct timer_file *tf = kernel->timer_heap[0];
+
+		if (tf->interval) {
+			uint64_t overruns = (kernel->virtual_clock - tf->expiration) / tf->interval + 1;
+			tf->expirations += overruns;
+			arm_timer(tf, tf->expiration + overruns * tf->interval, tf->interval);
+		} else {
+			tf->expirations++;
+			disarm_timer(tf);
+		}
+
+		signal_edge((struct file *) tf, EPOLLIN);
+
+		if (tf->pending_index == -1) {
+			tf->pending_index = kernel->num_pending_timers;
+			kernel->pending_timers[kernel->num_pending_timers++] = tf;
+			COVER(COVER_PENDING_TIMERS, log2_bucket(kernel->num_pending_timers));
+		}
+	}
+}
+
+/* Sleeps until the next timer expires, but no longer than timeout ms unless that is -1 */
+void sleep_virtual_clock(int timeout) {
+	uint64_t wakeup = timeout > 0 ? kernel->virtual_clock + timeout * 1000000ull : UINT64_MAX;
+	if (kernel->timer_heap_size && kernel->timer_heap[0]->expiration < wakeup) {
+		wakeup = kernel->timer_heap[0]->expiration;
+	}
+	if (wakeup != UINT64_MAX) {
+		kernel->virtual_clock = wakeup;
+	}
+	expire_timers();
+}
+
+/* The epoll syscalls */
+
+/* One registered FD, laid out densely so that epoll_wait is a linear sweep */
+struct epoll_interest {
+	int fd;
+	int type;
+	struct epoll_event epev;
+	struct file *f;
+
+	/* Readiness that is new since last reported, for EPOLLET */
+	int edge_events;
+
+#ifdef SPARSE_READINESS
+	/* The epoll_wait call this interest was last reported in, and at what index */
+	unsigned int reported_wait;
+	int reported_index;
+#endif
+};
+
+struct epoll_file {
+	struct file base;
+
+	unsigned int num_waits;
+
+	/* The interest set, DEL swaps the last entry into the hole */
+	struct epoll_interest *interest;
+	int num_interest, interest_capacity;
+
+	/* Where the next teardown event is reported from, so that sockets take turns when they do not fit in one call */
+	int teardown_cursor;
+};
+
+/* Returns the position of ef in the registrations of f, or -1 */
+int find_registration(struct file *f, struct epoll_file *ef) {
+	for (int i = 0; i < f->num_registrations; i++) {
+		if (f->registrations[i].ef == ef) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* Removes registration r of f from its epoll set, this function is O(1) */
+void remove_registration(struct file *f, int r) {
+	struct epoll_file *ef = f->registrations[r].ef;
+	int index = f->registrations[r].index;
+
+	/* Swap the last interest into the hole and repoint its registration */
+	struct epoll_interest *last = &ef->interest[--ef->num_interest];
+	if (index != ef->num_interest) {
+		ef->interest[index] = *last;
+		last->f->registrations[find_registration(last->f, ef)].index = index;
+	}
+
+	f->registrations[r] = f->registrations[--f->num_registrations];
+}
+
+/* Moves the registrations of f to an array twice as large, returns non-null on error */
+int grow_registrations(struct file *f) {
+	int capacity = f->registrations_capacity * 2;
+	begin_mock_allocation();
+	struct registration *registrations = (struct registration *) malloc(capacity * sizeof(struct registration));
+	end_mock_allocation();
+	if (!registrations) {
+		return -1;
+	}
+
+	memcpy(registrations, f->registrations, f->num_registrations * sizeof(struct registration));
+	if (f->registrations != f->inline_registrations) {
+		free(f->registrations);
+	}
+	f->registrations = registrations;
+	f->registrations_capacity = capacity;
+	return 0;
+}
+
+/* A closed file leaves every epoll set, and a closed epoll set releases all of its files */
+void forget_registrations(struct file *f) {
+	while (f->num_registrations) {
+		remove_registration(f, f->num_registrations - 1);
+	}
+	if (f->registrations != f->inline_registrations) {
+		free(f->registrations);
+		f->registrations = f->inline_registrations;
+		f->registrations_capacity = INLINE_REGISTRATIONS;
+	}
+
+	if (f->type == FD_TYPE_EPOLL) {
+		struct epoll_file *ef = (struct epoll_file *) f;
+		for (int i = 0; i < ef->num_interest; i++) {
+			struct file *registered = ef->interest[i].f;
+			if (registered->claim_owner == ef) {
+				registered->claim_owner = NULL;
+			}
+			int r = find_registration(registered, ef);
+			registered->registrations[r] = registered->registrations[--registered->num_registrations];
+		}
+		ef->num_interest = 0;
+
+		if (ef->interest_capacity > kernel->spare_interest_capacity) {
+			free(kernel->spare_interest);
+			kernel->spare_interest = ef->interest;
+			kernel->spare_interest_capacity = ef->interest_capacity;
+		} else {
+			free(ef->interest);
+		}
+		ef->interest = NULL;
+	}
+}
+
+/* This function is O(1) and only consumes fuzz data under RESOURCE_PRESSURE, but will fail if run out of FDs */
+int __wrap_epoll_create1(int flags) {
+
+	int fd = create_fd(0);
+	struct epoll_file *ef = (struct epoll_file *) alloc_file(&fd, &kernel->epoll_pool, sizeof(struct epoll_file));
+
+	if (ef) {
+		/* Init the epoll_file */
+		ef->interest = kernel->spare_interest;
+		ef->interest_capacity = kernel->spare_interest_capacity;
+		ef->num_interest = 0;
+		ef->num_waits = 0;
+		ef->teardown_cursor = 0;
+		kernel->spare_interest = NULL;
+		kernel->spare_interest_capacity = 0;
+
+		init_fd(fd, FD_TYPE_EPOLL, (struct file *)ef);
+	}
+
+	return TRACE(TRACE_EPOLL_CREATE1, -1, flags, 0, fd);
+}
+
+/* This function is O(1) and does not consume any fuzz data */
+int __wrap_epoll_ctl(int epfd, int op, int fd, struct epoll_event *event) {
+
+	struct epoll_file *ef = (struct epoll_file *)map_fd(epfd);
+	if (!ef || ef->base.type != FD_TYPE_EPOLL) {
+		errno = ef ? EINVAL : EBADF;
+		return TRACE(TRACE_EPOLL_CTL, epfd, op, fd, -1);
+	}
+
+	struct file *f = (struct file *)map_fd(fd);
+	if (!f) {
+		errno = EBADF;
+		return TRACE(TRACE_EPOLL_CTL, epfd, op, fd, -1);
+	}
+
+	if (epfd == fd) {
+		errno = EINVAL;
+		return TRACE(TRACE_EPOLL_CTL, epfd, op, fd, -1);
+	}
+
+	int r = find_registration(f, ef);
+
+	/* Exclusive wakeups can only be added, not with one-shot and not for epoll sets */
+	if (event && (event->events & EPOLLEXCLUSIVE) && (op != EPOLL_CTL_ADD || (event->events & EPOLLONESHOT) || f->type == FD_TYPE_EPOLL)) {
+		errno = EINVAL;
+		return TRACE(TRACE_EPOLL_CTL, epfd, op, fd, -1);
+	}
+
+	if (op == EPOLL_CTL_ADD) {
+		if (r != -1) {
+			errno = EEXIST;
+			return TRACE(TRACE_EPOLL_CTL, epfd, op, fd, -1);
+		}
+
+		if (f->num_registrations == f->registrations_capacity && grow_registrations(f)) {
+			errno = ENOMEM;
+			return TRACE(TRACE_EPOLL_CTL, epfd, op, fd, -1);
+		}
+
+		if (ef->num_interest == ef->interest_capacity) {
+			int capacity = ef->interest_capacity ? ef->interest_capacity * 2 : 64;
+			begin_mock_allocation();
+			struct epoll_interest *interest = (struct epoll_interest *) realloc(ef->interest, capacity * sizeof(struct epoll_interest));
+			end_mock_allocation();
+			if (!interest) {
+				errno = ENOMEM;
+				return TRACE(TRACE_EPOLL_CTL, epfd, op, fd, -1);
+			}
+			ef->interest = interest;
+			ef->interest_capacity = capacity;
+		}
+
+		/* We add new polls at the end */
+		struct epoll_interest *ei = &ef->interest[ef->num_interest];
+		ei->fd = fd;
+		ei->type = f->type;
+		ei->f = f;
+		ei->epev = *event;
+		ei->edge_events = ~0;
+#ifdef SPARSE_READINESS
+		ei->reported_wait = 0;
+#endif
+
+		/* You have to poll for errors and hangups */
+		ei->epev.events |= EPOLLERR | EPOLLHUP;
+
+		f->registrations[f->num_registrations].ef = ef;
+		f->registrations[f->num_registrations++].index = ef->num_interest++;
+		COVER(COVER_INTEREST, log2_bucket(ef->num_interest));
+
+	} else if (op == EPOLL_CTL_MOD) {
+		if (r == -1) {
+			errno = ENOENT;
+			return TRACE(TRACE_EPOLL_CTL, epfd, op, fd, -1);
+		}
+
+		struct epoll_interest *ei = &ef->interest[f->registrations[r].index];
+		if (ei->epev.events & EPOLLEXCLUSIVE) {
+			errno = EINVAL;
+			return TRACE(TRACE_EPOLL_CTL, epfd, op, fd, -1);
+		}
+
+		/* Modifying rearms one-shot interests, and whatever is ready counts as new */
+		ei->epev = *event;
+		ei->epev.events |= EPOLLERR | EPOLLHUP;
+		ei->edge_events = ~0;
+
+	} else if (op == EPOLL_CTL_DEL) {
+		if (r == -1) {
+			errno = ENOENT;
+			return TRACE(TRACE_EPOLL_CTL, epfd, op, fd, -1);
+		}
+
+		remove_registration(f, r);
+	} else {
+		errno = EINVAL;
+		return TRACE(TRACE_EPOLL_CTL, epfd, op, fd, -1);
+	}
+
+	return TRACE(TRACE_EPOLL_CTL, epfd, op, fd, 0);
+}
+
+/* The flags of an interest which are not events */
+const unsigned int EPOLL_PRIVATE_EVENTS = EPOLLONESHOT | EPOLLET | EPOLLEXCLUSIVE | EPOLLWAKEUP;
+
+/* New readiness on a file, for every edge-triggered interest in it */
+void signal_edge(struct file *f, int events) {
+	for (int r = 0; r < f->num_registrations; r++) {
+		f->registrations[r].ef->interest[f->registrations[r].index].edge_events |= events;
+	}
+}
+
+/* Applies EPOLLET, EPOLLEXCLUSIVE and EPOLLONESHOT of an interest to the events ready on its file.
+ * Edge events are readiness that just arrived, only these wake edge-triggered interests */
+int deliver_events(struct epoll_file *ef, struct epoll_interest *ei, int ready_events, int edge_events) {
+	if (ei->epev.events & EPOLLET) {
+		ei->edge_events |= edge_events;
+		ready_events &= ei->edge_events;
+	}
+
+	/* An exclusive event goes to one epoll set, which keeps it until it waits again */
+	if (ready_events && (ei->epev.events & EPOLLEXCLUSIVE)) {
+		struct file *f = ei->f;
+		if (f->claim_owner && f->claim_owner != ef && f->claim_wait == f->claim_owner->num_waits) {
+			return 0;
+		}
+		f->claim_owner = ef;
+		f->claim_wait = ef->num_waits;
+	}
+
+	if (!ready_events) {
+		return 0;
+	}
+
+	ei->edge_events &= ~ready_events;
+
+	/* One-shot interests are disarmed until modified */
+	if (ei->epev.events & EPOLLONESHOT) {
+		ei->epev.events &= EPOLL_PRIVATE_EVENTS;
+	}
+
+	if (ei->type == FD_TYPE_SOCKET && (ready_events & EPOLLIN)) {
+		kernel->read_stats.readable_reports++;
+	}
+
+#ifdef CONNECTION_MEMORY
+	/* The target serves the first event first */
+	if (kernel->memory_owner == -1) {
+		charge_memory_to(ei->fd, ei->f);
+	}
+#endif
+	return ready_events;
+}
+
+/* Receive queues, see the socket syscalls */
+int socket_events(struct epoll_interest *ei, int fuzz_events, int *edge_events);
+int wait_for_sockets(struct epoll_file *ef, struct epoll_event *events, int ready_events, int maxevents, int scanned);
+void count_undrained_sockets();
+void begin_iteration();
+
+/* Counters, see the eventfd syscalls */
+struct event_file;
+int event_events(struct epoll_interest *ei, int fuzz_events, int *edge_events);
+int event_read(struct event_file *ef, int fd, void *buf, size_t count);
+int event_write(struct event_file *ef, int fd, const void *buf, size_t count);
+
+/* Datagram queues, see the socket syscalls */
+int datagram_events(struct epoll_interest *ei, int fuzz_events, int *edge_events);
+
+/* The events fuzz data makes ready on an interest */
+int fuzz_interest(struct epoll_file *ef, struct epoll_interest *ei, int fuzz_events) {
+	int ready_events = fuzz_events & ei->epev.events, edge_events = ready_events;
+	if (ei->type == FD_TYPE_SOCKET) {
+		ready_events = socket_events(ei, fuzz_events, &edge_events);
+	} else if (ei->type == FD_TYPE_EVENT) {
+		ready_events = event_events(ei, fuzz_events, &edge_events);
+	} else if (ei->type == FD_TYPE_DATAGRAM) {
+		ready_events = datagram_events(ei, fuzz_events, &edge_events);
+	}
+	return deliver_events(ef, ei, ready_events, edge_events);
+}
+
+/* Appends readable timers polled by ef, sleeping the virtual clock if nothing else is ready.
+ * This function is O(readable timers) */
+int wait_for_timers(struct epoll_file *ef, struct epoll_event *events, int ready_events, int maxevents, int timeout) {
+	expire_timers();
+
+	for (int slept = 0; slept < 2; slept++) {
+		for (int i = 0; i < kernel->num_pending_timers && ready_events < maxevents; i++) {
+			struct file *f = (struct file *) kernel->pending_timers[i];
+			int r = find_registration(f, ef);
+			if (r == -1) {
+				continue;
+			}
+
+			struct epoll_interest *ei = &ef->interest[f->registrations[r].index];
+			if (deliver_events(ef, ei, ei->epev.events & EPOLLIN, 0)) {
+				(void) TRACE(TRACE_EPOLL_EVENT, ei->fd, EPOLLIN, 0, 0);
+				events[ready_events] = ei->epev;
+				events[ready_events++].events = EPOLLIN;
+			}
+		}
+
+		if (ready_events || !timeout) {
+			break;
+		}
+		sleep_virtual_clock(timeout);
+	}
+
+	return ready_events;
+}
+
+#ifdef SPARSE_READINESS
+/* This function is O(ready events) */
+int sparse_epoll_wait(struct epoll_file *ef, struct epoll_event *events, int maxevents, int timeout) {
+	unsigned char count;
+	int start = input_offset();
+	if (!ef->num_interest || consume_byte(&count)) {
+		return wait_for_timers(ef, events, wait_for_sockets(ef, events, 0, maxevents, 0), maxevents, timeout);
+	}
+
+	/* An interest reported twice in one call has its events merged */
+	unsigned int wait = ef->num_waits;
+	int ready_events = 0;
+
+	RECORD(RECORD_READY, start);
+
+	for (int i = 0; i < count; i++) {
+		/* The index takes as many bytes as it needs to reach every interest */
+		unsigned char index_byte, mask;
+		unsigned int index = 0;
+		int out_of_data = 0;
+		start = input_offset();
+		for (uint64_t range = 1; range < (uint64_t) ef->num_interest && !out_of_data; range <<= 8) {
+			out_of_data = consume_byte(&index_byte);
+			index = (index << 8) | index_byte;
+		}
+		if (out_of_data || consume_byte(&mask)) {
+			break;
+		}
+		RECORD(RECORD_READY, start);
+
+		struct epoll_interest *ei = &ef->interest[index % ef->num_interest];
+
+		/* Timers are driven by the virtual clock */
+		if (ei->type == FD_TYPE_TIMER) {
+			continue;
+		}
+
+		/* Without room, the events are left for a later call */
+		if (ei->reported_wait != wait && ready_events == maxevents) {
+			continue;
+		}
+
+		int ready_event = fuzz_interest(ef, ei, mask);
+		if (!ready_event) {
+			continue;
+		}
+
+		(void) TRACE(TRACE_EPOLL_EVENT, ei->fd, ready_event, 0, 0);
+
+		if (ei->reported_wait == wait) {
+			events[ei->reported_index].events |= ready_event;
+		} else {
+			ei->reported_wait = wait;
+			ei->reported_index = ready_events;
+			events[ready_events] = ei->epev;
+			events[ready_events++].events = ready_event;
+		}
+	}
+
+	ready_events = wait_for_sockets(ef, events, ready_events, maxevents, 0);
+	return wait_for_timers(ef, events, ready_events, maxevents, timeout);
+}
+#endif
+
+/* Reports EPOLLERR | EPOLLHUP on the sockets polled by ef which teardown closes. When they do not
+ * all fit in maxevents, every call carries on where the last one stopped, so that all of them are
+ * reported within a few calls even when the target does not close them right away.
+ * This function is O(n) */
+int teardown_events(struct epoll_file *ef, struct epoll_event *events, int maxevents) {
+	int ready_events = 0, start = ef->teardown_cursor;
+	for (int scanned = 0; scanned < ef->num_interest && ready_events < maxevents; scanned++) {
+		int i = (start + scanned) % ef->num_interest;
+		struct epoll_interest *ei = &ef->interest[i];
+
+#ifdef SNAPSHOT_SETUP
+		/* Only what this input opened */
+		if ((ei->type != FD_TYPE_SOCKET && ei->type != FD_TYPE_DATAGRAM) || kernel->snapshot_open[fd_slot(ei->fd)]) {
+			continue;
+		}
+#else
+		if (ei->type != FD_TYPE_SOCKET && ei->type != FD_TYPE_DATAGRAM) {
+			continue;
+		}
+#endif
+
+		(void) TRACE(TRACE_EPOLL_EVENT, ei->fd, EPOLLERR | EPOLLHUP, 0, 0);
+		events[ready_events] = ei->epev;
+		events[ready_events++].events = EPOLLERR | EPOLLHUP;
+		ef->teardown_cursor = i + 1;
+	}
+	return ready_events;
+}
+
+#ifdef SNAPSHOT_SETUP
+int snapshot_taken();
+void take_snapshot_and_park();
+int snapshot_drain(struct epoll_file *ef, struct epoll_event *events, int maxevents);
+#endif
+
+/* This function is O(n) and consumes fuzz data and might trigger teardown callback */
+int __wrap_epoll_wait(int epfd, struct epoll_event *events,
+               int maxevents, int timeout) {
+	//printf("epoll_wait: %d\n", 0);
+
+	struct epoll_file *ef = (struct epoll_file *)map_fd(epfd);
+	if (!ef || ef->base.type != FD_TYPE_EPOLL) {
+		errno = ef ? EINVAL : EBADF;
+		return TRACE(TRACE_EPOLL_WAIT, epfd, maxevents, timeout, -1);
+	}
+
+#ifdef REPLAY_MAIN
+	replay_step(epfd, ef->num_interest);
+#endif
+
+	begin_iteration();
+	ef->num_waits++;
+
+#ifdef SNAPSHOT_SETUP
+	/* The first epoll_wait marks the end of setup */
+	if (!snapshot_taken()) {
+		take_snapshot_and_park();
+	}
+#endif
+
+#ifdef LOADGEN_MAIN
+	if (loadgen_iteration()) {
+#else
+	if (kernel->consumable_data_length) {
+#endif
+		count_undrained_sockets();
+		RECORD(RECORD_WAIT, input_offset());
+
+#ifdef SPARSE_READINESS
+		int sparse_events = sparse_epoll_wait(ef, events, maxevents, timeout);
+		COVER(COVER_READY_EVENTS, log2_bucket(sparse_events));
+		return TRACE(TRACE_EPOLL_WAIT, epfd, maxevents, timeout, sparse_events);
+#endif
+
+		int ready_events = 0, scanned;
+
+		for (scanned = 0; scanned < ef->num_interest; scanned++) {
+			struct epoll_interest *ei = &ef->interest[scanned];
+
+			/* Timers are driven by the virtual clock, and disarmed one-shot interests cannot fire */
+			if (ei->type == FD_TYPE_TIMER || !(ei->epev.events & ~EPOLL_PRIVATE_EVENTS)) {
+				continue;
+			}
+
+#ifdef LOADGEN_MAIN
+			if (ready_events == maxevents) {
+				break;
+			}
+
+			int fuzz_event = loadgen_events(ei);
+#else
+			/* Consume one fuzz byte, AND it with the event */
+			if (!kernel->consumable_data_length) {
+				// break if we have no data
+				break;
+			}
+
+			if (ready_events == maxevents) {
+				// we are full, break
+				break;
+			}
+
+			// here we have the main condition that drives everything
+			unsigned char fuzz_event = kernel->consumable_data[0];
+
+			// consume the byte
+			kernel->consumable_data_length--;
+			kernel->consumable_data++;
+			RECORD(RECORD_READY, input_offset() - 1);
+#endif
+
+			int ready_event = fuzz_interest(ef, ei, fuzz_event);
+			if (ready_event) {
+				(void) TRACE(TRACE_EPOLL_EVENT, ei->fd, ready_event, 0, 0);
+				events[ready_events] = ei->epev;
+				events[ready_events++].events = ready_event;
+			}
+
+		}
+
+		/* Readable sockets we did not get to are reported as well */
+		ready_events = wait_for_sockets(ef, events, ready_events, maxevents, scanned);
+		ready_events = wait_for_timers(ef, events, ready_events, maxevents, timeout);
+		COVER(COVER_READY_EVENTS, log2_bucket(ready_events));
+
+		return TRACE(TRACE_EPOLL_WAIT, epfd, maxevents, timeout, ready_events);
+
+	} else {
+
+#ifdef SNAPSHOT_SETUP
+		/* Instead of tearing down, we error-close what this input opened and rewind */
+		int drained_events = snapshot_drain(ef, events, maxevents);
+		if (drained_events) {
+			return TRACE(TRACE_EPOLL_WAIT, epfd, maxevents, timeout, drained_events);
+		}
+
+		/* We were parked and have been resumed with the next input */
+		return __wrap_epoll_wait(epfd, events, maxevents, timeout);
+#endif
+		/* Every other event loop only sees its sockets error */
+		if (!kernel->torn_down) {
+			kernel->torn_down = 1;
+			(void) TRACE(TRACE_TEARDOWN, -1, 0, 0, 0);
+			teardown();
+		}
+
+		/* You don't really need to emit teardown, you could simply emit error on every poll */
+		return TRACE(TRACE_EPOLL_WAIT, epfd, maxevents, timeout, teardown_events(ef, events, maxevents));
+	}
+}
+
+/* The socket syscalls */
+
+struct socket_file {
+	struct file base;
+
+	/* We store socket addresses created in accept4 */
+	union {
+		struct sockaddr_in6 in6;
+		struct sockaddr_in in;
+	} addr;
+
+	/* The size of sockaddr_in6 or sockaddr_in as a whole */
+	socklen_t len;
+
+	/* Listening sockets are readable when there is a connection to accept, not data */
+	int listening;
+
+	/* Sockets from socket() are connected by connect, accepted sockets already are.
+	 * A failed connect leaves its error for the next syscall to pick up */
+	int connect_state;
+	int so_error;
+
+	/* The port bound, and whether the socket may share it with SO_REUSEPORT */
+	int port;
+	int reuseport;
+
+	/* Listeners sharing a port form a ring, and connections to it are queued on one of them */
+	struct socket_file *reuseport_next;
+	int incoming;
+
+#ifdef RESOURCE_PRESSURE
+	/* Connections a listener failed to accept for lack of FDs or memory, these keep it readable */
+	int backlog;
+#endif
+
+	/* The receive queue is a segment of fuzz data, read drains it and then returns EOF if set */
+	const unsigned char *rx_data;
+	int rx_length;
+	int rx_eof;
+	int readable_index;
+
+	/* The send buffer only has room for so many bytes, the peer drains it */
+	int tx_capacity;
+	int tx_length;
+	int tx_peak;
+
+#ifdef CONNECTION_MEMORY
+	/* The id of the connection, and the heap bytes the target holds for it, now and at most */
+	uint64_t connection;
+	size_t heap_bytes, heap_peak;
+#endif
+
+#ifdef LOADGEN_MAIN
+	/* Requests the load generator has yet to send, -1 for sockets it does not drive,
+	 * and the requests in the receive queue */
+	int requests_left;
+	int requests_queued;
+	int upgraded;
+#endif
+
+	/* Writes are held back while corked, or while they carry MSG_MORE, and then leave as one message */
+	int corked;
+	int message_syscalls;
+	int message_bytes;
+
+	/* Messages flushed in the current event-loop iteration */
+	unsigned int flush_iteration;
+	int iteration_flushes;
+};
+
+/* Like the default of net.ipv4.tcp_wmem */
+const int SEND_BUFFER_SIZE = 16384;
+
+/* SO_SNDBUF is clamped to net.core.wmem_max, then doubled to at least SOCK_MIN_SNDBUF */
+const int WMEM_MAX = 212992;
+const int MIN_SEND_BUFFER_SIZE = 4608;
+
+const int CONNECT_NONE = 0;
+const int CONNECT_PENDING = 1;
+const int CONNECT_DONE = 2;
+const int CONNECT_FAILED = 3;
+
+/* How long an unanswered connect takes to time out, like the default of net.ipv4.tcp_syn_retries */
+const uint64_t CONNECT_TIMEOUT_NS = 127000000000ull;
+
+void init_socket_file(struct socket_file *sf) {
+	kernel->num_sockets++;
+	COVER(COVER_OPEN_SOCKETS, log2_bucket(kernel->num_sockets));
+
+	sf->listening = 0;
+	sf->connect_state = CONNECT_NONE;
+	sf->so_error = 0;
+	sf->port = 0;
+	sf->reuseport = 0;
+	sf->reuseport_next = NULL;
+	sf->incoming = 0;
+#ifdef RESOURCE_PRESSURE
+	sf->backlog = 0;
+#endif
+	sf->rx_data = NULL;
+	sf->rx_length = 0;
+	sf->rx_eof = 0;
+	sf->readable_index = -1;
+	sf->tx_capacity = SEND_BUFFER_SIZE;
+	sf->tx_length = 0;
+	sf->tx_peak = 0;
+#ifdef CONNECTION_MEMORY
+	sf->connection = kernel->next_connection++;
+	sf->heap_bytes = 0;
+	sf->heap_peak = 0;
+#endif
+#ifdef LOADGEN_MAIN
+	sf->requests_left = -1;
+	sf->requests_queued = 0;
+	sf->upgraded = 0;
+#endif
+	sf->corked = 0;
+	sf->message_syscalls = 0;
+	sf->message_bytes = 0;
+	sf->flush_iteration = 0;
+	sf->iteration_flushes = 0;
+}
+
+void set_readable(struct socket_file *sf, int readable) {
+	if (readable && sf->readable_index == -1) {
+		sf->readable_index = kernel->num_readable_sockets;
+		kernel->readable_sockets[kernel->num_readable_sockets++] = sf;
+		COVER(COVER_READABLE_SOCKETS, log2_bucket(kernel->num_readable_sockets));
+	} else if (!readable && sf->readable_index != -1) {
+		kernel->readable_sockets[sf->readable_index] = kernel->readable_sockets[--kernel->num_readable_sockets];
+		kernel->readable_sockets[sf->readable_index]->readable_index = sf->readable_index;
+		sf->readable_index = -1;
+	}
+}
+
+/* Queues the next segment of fuzz data, a length byte followed by up to that many bytes.
+ * A length of zero is the peer shutting down its side */
+void fill_receive_queue(struct socket_file *sf, int fd) {
+	int start = input_offset();
+#ifdef LOADGEN_MAIN
+	const unsigned char *data;
+	int length = loadgen_segment(sf, &data);
+	if (length == -1) {
+		return;
+	}
+#else
+	unsigned char length;
+	if (consume_byte(&length)) {
+		return;
+	}
+#endif
+
+	if (!length) {
+		sf->rx_eof = 1;
+	} else {
+#ifdef LOADGEN_MAIN
+		sf->rx_data = data;
+		sf->rx_length = length;
+#else
+		sf->rx_data = kernel->consumable_data;
+		sf->rx_length = length < kernel->consumable_data_length ? length : kernel->consumable_data_length;
+		kernel->consumable_data += sf->rx_length;
+		kernel->consumable_data_length -= sf->rx_length;
+#endif
+
+		kernel->read_stats.segments++;
+		kernel->read_stats.bytes_queued += sf->rx_length;
+	}
+	RECORD(RECORD_RECEIVE, start);
+
+	(void) TRACE(TRACE_RECEIVE, fd, sf->rx_eof ? 0 : sf->rx_length, 0, 0);
+	set_readable(sf, sf->rx_length || sf->rx_eof);
+	signal_edge((struct file *) sf, sf->rx_eof ? EPOLLIN | EPOLLRDHUP : EPOLLIN);
+}
+
+/* The peer acknowledges a fraction of the send buffer, scaled by one byte */
+void drain_send_buffer(struct socket_file *sf, int fd) {
+	unsigned char scale;
+	if (consume_byte(&scale)) {
+		return;
+	}
+	RECORD(RECORD_DECISION, input_offset() - 1);
+
+	int drained = (int) (((long long) sf->tx_length * (scale + 1) + 255) / 256);
+	sf->tx_length -= drained;
+	signal_edge((struct file *) sf, EPOLLOUT);
+
+	kernel->send_stats.drains++;
+	(void) TRACE(TRACE_DRAIN, fd, drained, 0, 0);
+}
+
+/* One byte decides whether a connect completes, is refused or times out, which takes virtual time */
+void complete_connect(struct socket_file *sf, int fd) {
+	unsigned char b;
+	if (consume_byte(&b)) {
+		return;
+	}
+	RECORD(RECORD_DECISION, input_offset() - 1);
+
+	if (b % 4 < 2) {
+		sf->connect_state = CONNECT_DONE;
+		signal_edge((struct file *) sf, EPOLLOUT);
+		(void) TRACE(TRACE_CONNECTED, fd, 0, 0, 0);
+		return;
+	}
+
+	if (b % 4 == 3) {
+		kernel->virtual_clock += CONNECT_TIMEOUT_NS;
+		expire_timers();
+	}
+
+	/* The socket is dead, readable as EOF once the error is picked up */
+	sf->connect_state = CONNECT_FAILED;
+	sf->so_error = b % 4 == 3 ? ETIMEDOUT : ECONNREFUSED;
+	sf->rx_eof = 1;
+	set_readable(sf, 1);
+	signal_edge((struct file *) sf, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLERR | EPOLLHUP);
+	(void) TRACE(TRACE_CONNECTED, fd, sf->so_error, 0, 0);
+}
+
+/* A connection to a SO_REUSEPORT group is queued on the member fuzz data picks,
+ * which may well be polled by another event loop than the one that saw it */
+void shard_connection(struct socket_file *sf) {
+	int members = 1;
+	for (struct socket_file *member = sf->reuseport_next; member != sf; member = member->reuseport_next) {
+		members++;
+	}
+
+	unsigned char b = 0;
+	if (members > 1 && !consume_byte(&b)) {
+		RECORD(RECORD_DECISION, input_offset() - 1);
+	}
+
+	struct socket_file *chosen = sf;
+	for (int i = 0; i < b % members; i++) {
+		chosen = chosen->reuseport_next;
+	}
+	chosen->incoming++;
+	signal_edge((struct file *) chosen, EPOLLIN);
+}
+
+/* Members join in listen and leave in close */
+void join_reuseport_group(struct socket_file *sf) {
+	for (int slot = 0; slot < kernel->fd_watermark; slot++) {
+		struct socket_file *member = (struct socket_file *) *slot_file(slot);
+		if (member && member != sf && member->base.type == FD_TYPE_SOCKET && member->reuseport_next && member->port == sf->port) {
+			sf->reuseport_next = member->reuseport_next;
+			member->reuseport_next = sf;
+			return;
+		}
+	}
+	sf->reuseport_next = sf;
+}
+
+void leave_reuseport_group(struct socket_file *sf) {
+	struct socket_file *previous = sf;
+	while (previous->reuseport_next != sf) {
+		previous = previous->reuseport_next;
+	}
+	previous->reuseport_next = sf->reuseport_next;
+	sf->reuseport_next = NULL;
+}
+
+/* Turns the events fuzz data gave a socket into its events, whether the target polls them or not.
+ * EPOLLIN fills an empty receive queue and EPOLLOUT drains the send buffer, but whether the
+ * socket is readable and writable follows from its queue and buffer */
+int socket_events(struct epoll_interest *ei, int fuzz_events, int *edge_events) {
+	struct socket_file *sf = (struct socket_file *) ei->f;
+	if (sf->listening && sf->reuseport_next) {
+		if (fuzz_events & ei->epev.events & EPOLLIN) {
+			shard_connection(sf);
+		}
+		*edge_events = fuzz_events & ~EPOLLIN & ei->epev.events;
+		return (*edge_events | (sf->incoming ? EPOLLIN : 0)) & ei->epev.events;
+	}
+
+	if (sf->listening) {
+		*edge_events = fuzz_events & ei->epev.events;
+#ifdef RESOURCE_PRESSURE
+		return (*edge_events | (sf->backlog ? EPOLLIN : 0)) & ei->epev.events;
+#else
+		return *edge_events;
+#endif
+	}
+
+	/* A connect is resolved once fuzz data makes the socket writable */
+	if (sf->connect_state == CONNECT_PENDING) {
+		if (fuzz_events & ei->epev.events & EPOLLOUT) {
+			complete_connect(sf, ei->fd);
+		}
+		if (sf->connect_state == CONNECT_PENDING) {
+			*edge_events = fuzz_events & ~(EPOLLIN | EPOLLOUT | EPOLLRDHUP) & ei->epev.events;
+			return *edge_events;
+		}
+	}
+
+	/* Data only arrives while the target waits for it, as it costs fuzz data */
+	if ((fuzz_events & ei->epev.events & EPOLLIN) && !sf->rx_length && !sf->rx_eof) {
+		fill_receive_queue(sf, ei->fd);
+	}
+
+	int ready_events = 0;
+	if (sf->readable_index != -1) {
+		ready_events = sf->rx_eof ? EPOLLIN | EPOLLRDHUP : EPOLLIN;
+	}
+	if (sf->connect_state == CONNECT_FAILED) {
+		ready_events |= EPOLLOUT | EPOLLERR | EPOLLHUP;
+	}
+
+	/* Writable once the peer has made room */
+	if (fuzz_events & EPOLLOUT) {
+		if (sf->tx_length) {
+			drain_send_buffer(sf, ei->fd);
+		}
+		if (sf->tx_length < sf->tx_capacity) {
+			ready_events |= EPOLLOUT;
+		}
+	}
+
+	/* The queue and buffer signal their own edges, the rest of what fuzz data gives is new */
+	*edge_events = fuzz_events & ~(EPOLLIN | EPOLLOUT | EPOLLRDHUP) & ei->epev.events;
+	return (*edge_events | ready_events) & ei->epev.events;
+}
+
+/* Appends readable sockets polled by ef which were not scanned already, this function is O(readable sockets) */
+int wait_for_sockets(struct epoll_file *ef, struct epoll_event *events, int ready_events, int maxevents, int scanned) {
+	for (int i = 0; i < kernel->num_readable_sockets; i++) {
+		struct file *f = (struct file *) kernel->readable_sockets[i];
+		int r = find_registration(f, ef);
+		if (r == -1 || f->registrations[r].index < scanned) {
+			continue;
+		}
+
+		struct epoll_interest *ei = &ef->interest[f->registrations[r].index];
+
+#ifdef SPARSE_READINESS
+		/* Already reported by fuzz data in this call, including its queue */
+		if (ei->reported_wait == ef->num_waits) {
+			continue;
+		}
+#endif
+
+		if (ready_events == maxevents) {
+			break;
+		}
+
+		int edge_events;
+		int ready_event = deliver_events(ef, ei, socket_events(ei, 0, &edge_events), 0);
+		if (!ready_event) {
+			continue;
+		}
+
+		(void) TRACE(TRACE_EPOLL_EVENT, ei->fd, ready_event, 0, 0);
+		events[ready_events] = ei->epev;
+		events[ready_events++].events = ready_event;
+	}
+
+	return ready_events;
+}
+
+#ifdef ITERATION_TIMING
+uint64_t monotonic_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return timespec_to_ns(&ts);
+}
+
+void print_iteration_histogram(FILE *out) {
+	for (int i = 0; i < 64; i++) {
+		if (kernel->iteration_histogram[i]) {
+			fprintf(out, "%12llu ns and up: %llu iterations\n", 1ull << i, (unsigned long long) kernel->iteration_histogram[i]);
+		}
+	}
+}
+
+/* Crashes on an iteration that took longer than its budget, scaled by the bytes it read */
+void time_iteration() {
+	uint64_t now = monotonic_ns();
+
+	if (kernel->iteration_started) {
+		uint64_t elapsed = now - kernel->iteration_started;
+		uint64_t bytes = kernel->read_stats.bytes_read - kernel->iteration_bytes_read;
+		kernel->iteration_histogram[63 - __builtin_clzll(elapsed | 1)]++;
+		kernel->iteration_ns = elapsed;
+
+		uint64_t budget = ITERATION_BUDGET_NS + ITERATION_BUDGET_NS_PER_BYTE * bytes;
+		if (elapsed > budget) {
+			printf("ERROR! Event-loop iteration took %llu ns for %llu bytes read, budget is %llu ns!\n",
+				(unsigned long long) elapsed, (unsigned long long) bytes, (unsigned long long) budget);
+			print_iteration_histogram(stdout);
+			fuzzer_abort();
+		}
+	}
+
+	kernel->iteration_bytes_read = kernel->read_stats.bytes_read;
+	kernel->iteration_started = monotonic_ns();
+}
+#endif
+
+#ifdef RESOURCE_PRESSURE
+/* An iteration spins when all it did was fail for lack of FDs or memory. A target that keeps
+ * polling a listener it cannot accept from never blocks in epoll_wait */
+void detect_spin() {
+	uint64_t progress = kernel->read_stats.bytes_read + kernel->send_stats.bytes_sent + kernel->fd_changes;
+
+	if (kernel->iteration_pressure_errors && progress == kernel->iteration_progress) {
+		kernel->spin_iterations++;
+#ifdef ITERATION_TIMING
+		kernel->spin_ns += kernel->iteration_ns;
+#endif
+		if (kernel->spin_iterations > MAX_SPIN_ITERATIONS) {
+#ifdef ITERATION_TIMING
+			printf("ERROR! Target spun %d event-loop iterations (%llu ns) failing for lack of FDs or memory, without backing off!\n",
+				kernel->spin_iterations, (unsigned long long) kernel->spin_ns);
+#else
+			printf("ERROR! Target spun %d event-loop iterations failing for lack of FDs or memory, without backing off!\n",
+				kernel->spin_iterations);
+#endif
+			fuzzer_abort();
+		}
+	} else {
+		kernel->spin_iterations = 0;
+#ifdef ITERATION_TIMING
+		kernel->spin_ns = 0;
+#endif
+	}
+
+	kernel->iteration_pressure_errors = 0;
+	kernel->iteration_progress = progress;
+}
+#endif
+
+/* Sends are accounted per event-loop iteration, which ends with every epoll_wait */
+void begin_iteration() {
+#ifdef ITERATION_TIMING
+	time_iteration();
+#endif
+#ifdef RESOURCE_PRESSURE
+	detect_spin();
+#endif
+#ifdef CONNECTION_MEMORY
+	kernel->memory_owner = -1;
+#endif
+
+	if (kernel->iteration_sends) {
+		kernel->send_stats.sending_iterations++;
+		if (kernel->iteration_sends > kernel->send_stats.max_iteration_sends) {
+			kernel->send_stats.max_iteration_sends = kernel->iteration_sends;
+		}
+	}
+
+	kernel->iteration++;
+	kernel->iteration_sends = 0;
+}
+
+/* A target that drains its sockets goes back to epoll_wait with nothing queued */
+void count_undrained_sockets() {
+	int undrained = 0;
+	for (int i = 0; i < kernel->num_readable_sockets; i++) {
+		undrained += kernel->readable_sockets[i]->rx_length != 0;
+	}
+
+	kernel->read_stats.waits++;
+	kernel->read_stats.undrained_waits += undrained != 0;
+	kernel->read_stats.undrained_sockets += undrained;
+}
+
+void print_send_stats(FILE *out) {
+	struct send_stats *ss = &kernel->send_stats;
+	fprintf(out, "Sent %llu bytes in %llu sends (%llu partial, %llu found the buffer full), %llu drains\n",
+		(unsigned long long) ss->bytes_sent, (unsigned long long) ss->sends, (unsigned long long) ss->partial_sends,
+		(unsigned long long) ss->full_sends, (unsigned long long) ss->drains);
+	fprintf(out, "Peak of %d bytes buffered on one socket\n", ss->peak_buffered);
+	if (ss->messages) {
+		fprintf(out, "%llu messages, %.2f syscalls and %.1f bytes per message\n", (unsigned long long) ss->messages,
+			(double) ss->message_syscalls / ss->messages, (double) ss->bytes_sent / ss->messages);
+	}
+	fprintf(out, "%llu iterations sent anything, at most %d sends in one, %llu messages over budget\n",
+		(unsigned long long) ss->sending_iterations, ss->max_iteration_sends, (unsigned long long) ss->over_budget);
+}
+
+void print_read_stats(FILE *out) {
+	struct read_stats *rs = &kernel->read_stats;
+	fprintf(out, "Queued %llu bytes in %llu segments, read %llu bytes in %llu reads (%llu found nothing)\n",
+		(unsigned long long) rs->bytes_queued, (unsigned long long) rs->segments,
+		(unsigned long long) rs->bytes_read, (unsigned long long) rs->reads, (unsigned long long) rs->empty_reads);
+	if (rs->bytes_read) {
+		fprintf(out, "%.2f reads per KB received\n", rs->reads * 1024.0 / rs->bytes_read);
+	}
+	if (rs->readable_reports) {
+		fprintf(out, "%.2f reads per EPOLLIN\n", (double) rs->reads / rs->readable_reports);
+	}
+	fprintf(out, "%llu of %llu epoll_wait calls left data queued, on %llu sockets in total\n",
+		(unsigned long long) rs->undrained_waits, (unsigned long long) rs->waits, (unsigned long long) rs->undrained_sockets);
+}
+
+/* Datagram sockets */
+
+/* Datagrams queued on a socket at once, at most */
+const int MAX_QUEUED_DATAGRAMS = 64;
+
+/* Like UDP_MAX_SEGMENTS, for both GSO and GRO */
+const int MAX_UDP_SEGMENTS = 64;
+
+/* The largest UDP payload over ipv4 */
+const int MAX_DATAGRAM_SIZE = 65507;
+
+/* A datagram is a segment of fuzz data, and a byte picking where it came from */
+struct datagram {
+	const unsigned char *data;
+	int length;
+	unsigned char source;
+};
+
+struct datagram_file {
+	struct file base;
+
+	int family;
+
+	/* The receive queue is a ring of datagrams */
+	struct datagram queue[MAX_QUEUED_DATAGRAMS];
+	int queue_head, queue_length;
+
+	/* The UDP_SEGMENT size sends are split by, and whether UDP_GRO coalesces receives */
+	int gso_size;
+	int gro;
+};
+
+void init_datagram_file(struct datagram_file *df, int family) {
+	df->family = family;
+	df->queue_head = 0;
+	df->queue_length = 0;
+	df->gso_size = 0;
+	df->gro = 0;
+}
+
+/* Queues a batch of datagrams; a count byte and then per datagram a source byte, a length byte
+ * and up to that many bytes. Batches go up to MAX_QUEUED_DATAGRAMS and are cut short by a full queue */
+void fill_datagram_queue(struct datagram_file *df, int fd) {
+	unsigned char count;
+	if (consume_byte(&count)) {
+		return;
+	}
+	RECORD(RECORD_DECISION, input_offset() - 1);
+
+	int queued = 0, bytes = 0;
+	for (int i = 0; i <= count % MAX_QUEUED_DATAGRAMS && df->queue_length < MAX_QUEUED_DATAGRAMS; i++) {
+		unsigned char source, length;
+		if (consume_byte(&source)) {
+			break;
+		}
+		RECORD(RECORD_DECISION, input_offset() - 1);
+
+		if (consume_byte(&length)) {
+			break;
+		}
+
+		struct datagram *d = &df->queue[(df->queue_head + df->queue_length++) % MAX_QUEUED_DATAGRAMS];
+		d->source = source;
+		d->data = kernel->consumable_data;
+		d->length = length < kernel->consumable_data_length ? length : kernel->consumable_data_length;
+		kernel->consumable_data += d->length;
+		kernel->consumable_data_length -= d->length;
+
+		/* The length byte and the payload */
+		RECORD(RECORD_RECEIVE, input_offset() - d->length - 1);
+
+		queued++;
+		bytes += d->length;
+	}
+
+	kernel->read_stats.segments += queued;
+	kernel->read_stats.bytes_queued += bytes;
+	COVER(COVER_QUEUED_DATAGRAMS, log2_bucket(df->queue_length));
+
+	(void) TRACE(TRACE_DATAGRAMS, fd, queued, bytes, 0);
+	if (queued) {
+		signal_edge((struct file *) df, EPOLLIN);
+	}
+}
+
+/* Like sockets, EPOLLIN fills an empty queue while readability follows from the queue.
+ * There is always room to send */
+int datagram_events(struct epoll_interest *ei, int fuzz_events, int *edge_events) {
+	struct datagram_file *df = (struct datagram_file *) ei->f;
+	if ((fuzz_events & ei->epev.events & EPOLLIN) && !df->queue_length) {
+		fill_datagram_queue(df, ei->fd);
+	}
+
+	*edge_events = fuzz_events & ~(EPOLLIN | EPOLLOUT) & ei->epev.events;
+	return (*edge_events | EPOLLOUT | (df->queue_length ? EPOLLIN : 0)) & ei->epev.events;
+}
+
+size_t iovec_length(const struct iovec *iov, int iovcnt) {
+	size_t length = 0;
+	for (int i = 0; i < iovcnt; i++) {
+		length += iov[i].iov_len;
+	}
+	return length;
+}
+
+/* Copies as much as fits the iovecs past offset, returns what was copied */
+size_t copy_to_iovec(const struct iovec *iov, size_t iovcnt, size_t offset, const unsigned char *data, size_t length) {
+	size_t copied = 0;
+	for (size_t i = 0; i < iovcnt && copied < length; i++) {
+		if (offset >= iov[i].iov_len) {
+			offset -= iov[i].iov_len;
+			continue;
+		}
+		size_t room = iov[i].iov_len - offset;
+		size_t chunk = length - copied < room ? length - copied : room;
+		memcpy((char *) iov[i].iov_base + offset, data + copied, chunk);
+		copied += chunk;
+		offset = 0;
+	}
+	return copied;
+}
+
+/* Peers are 10.0.0.x or fd00::x, and port 1024 + x where x is the source byte */
+void datagram_source(struct datagram_file *df, unsigned char source, struct msghdr *msg) {
+	if (!msg->msg_name) {
+		msg->msg_namelen = 0;
+		return;
+	}
+
+	union {
+		struct sockaddr_in in;
+		struct sockaddr_in6 in6;
+	} addr = {};
+	socklen_t len;
+	if (df->family == AF_INET) {
+		addr.in.sin_family = AF_INET;
+		addr.in.sin_port = htons(1024 + source);
+		addr.in.sin_addr.s_addr = htonl(0x0a000000 | source);
+		len = sizeof(struct sockaddr_in);
+	} else {
+		addr.in6.sin6_family = AF_INET6;
+		addr.in6.sin6_port = htons(1024 + source);
+		addr.in6.sin6_addr.s6_addr[0] = 0xfd;
+		addr.in6.sin6_addr.s6_addr[15] = source;
+		len = sizeof(struct sockaddr_in6);
+	}
+
+	memcpy(msg->msg_name, &addr, len < msg->msg_namelen ? len : msg->msg_namelen);
+	msg->msg_namelen = len;
+}
+
+/* Receives the next datagram, or with UDP_GRO the run of equally sized datagrams from one source that
+ * fits the buffer. A datagram longer than the buffer is truncated and the rest of it is lost */
+int datagram_recvmsg(struct datagram_file *df, struct msghdr *msg, int flags) {
+	if (!df->queue_length) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	size_t capacity = iovec_length(msg->msg_iov, msg->msg_iovlen);
+	struct datagram *first = &df->queue[df->queue_head];
+	datagram_source(df, first->source, msg);
+
+	int segments = 1;
+	size_t length = first->length;
+	if (df->gro && first->length) {
+		while (segments < df->queue_length && segments < MAX_UDP_SEGMENTS) {
+			struct datagram *next = &df->queue[(df->queue_head + segments) % MAX_QUEUED_DATAGRAMS];
+			if (next->source != first->source || next->length > first->length || length + next->length > capacity) {
+				break;
+			}
+			length += next->length;
+			segments++;
+
+			/* A shorter segment ends the run */
+			if (next->length < first->length) {
+				break;
+			}
+		}
+	}
+
+	/* Coalesced segments are only next to each other in the queue, not in fuzz data */
+	size_t copied = 0;
+	for (int i = 0; i < segments; i++) {
+		struct datagram *d = &df->queue[(df->queue_head + i) % MAX_QUEUED_DATAGRAMS];
+		copied += copy_to_iovec(msg->msg_iov, msg->msg_iovlen, copied, d->data, d->length);
+	}
+
+	msg->msg_flags = copied < length ? MSG_TRUNC : 0;
+
+	/* The segment size of a coalesced receive comes as a control message */
+	size_t controllen = 0;
+	if (segments > 1) {
+		if (msg->msg_control && msg->msg_controllen >= CMSG_SPACE(sizeof(int))) {
+			struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg);
+			cmsg->cmsg_level = SOL_UDP;
+			cmsg->cmsg_type = UDP_GRO;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+			int segment_size = first->length;
+			memcpy(CMSG_DATA(cmsg), &segment_size, sizeof(int));
+			controllen = CMSG_SPACE(sizeof(int));
+		} else {
+			msg->msg_flags |= MSG_CTRUNC;
+		}
+	}
+	msg->msg_controllen = controllen;
+
+	if (!(flags & MSG_PEEK)) {
+		df->queue_head = (df->queue_head + segments) % MAX_QUEUED_DATAGRAMS;
+		df->queue_length -= segments;
+	}
+
+	kernel->read_stats.reads++;
+	kernel->read_stats.bytes_read += copied;
+	return (int) ((flags & MSG_TRUNC) ? length : copied);
+}
+
+/* Sends one datagram, or with a segment size a GSO buffer of up to MAX_UDP_SEGMENTS datagrams.
+ * Every datagram counts as a message, so batching shows as fewer syscalls per message */
+int datagram_send(size_t length, int gso_size) {
+	kernel->send_stats.sends++;
+	kernel->iteration_sends++;
+
+	if (gso_size ? length > (size_t) gso_size * MAX_UDP_SEGMENTS : length > (size_t) MAX_DATAGRAM_SIZE) {
+		errno = gso_size ? EINVAL : EMSGSIZE;
+		return -1;
+	}
+
+	int segments = gso_size && length ? (int) ((length + gso_size - 1) / gso_size) : 1;
+	kernel->send_stats.bytes_sent += length;
+	kernel->send_stats.messages += segments;
+	kernel->send_stats.message_syscalls++;
+
+	errno = 0;
+	return (int) length;
+}
+
+/* The UDP_SEGMENT of a message overrides that of its socket */
+int message_gso_size(struct datagram_file *df, const struct msghdr *msg) {
+	int gso_size = df->gso_size;
+	if (msg->msg_control) {
+		for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR((struct msghdr *) msg, cmsg)) {
+			if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_SEGMENT && cmsg->cmsg_len >= CMSG_LEN(sizeof(uint16_t))) {
+				uint16_t segment_size;
+				memcpy(&segment_size, CMSG_DATA(cmsg), sizeof(uint16_t));
+				gso_size = segment_size;
+			}
+		}
+	}
+	return gso_size;
+}
+
+/* Stream sockets take from their receive queue, scattered over the iovecs */
+int stream_recvmsg(struct socket_file *sf, struct msghdr *msg) {
+	kernel->read_stats.reads++;
+	msg->msg_flags = 0;
+	msg->msg_controllen = 0;
+
+	if (sf->rx_length) {
+		int copied = (int) copy_to_iovec(msg->msg_iov, msg->msg_iovlen, 0, sf->rx_data, sf->rx_length);
+		sf->rx_data += copied;
+		sf->rx_length -= copied;
+		set_readable(sf, sf->rx_length || sf->rx_eof);
+
+		kernel->read_stats.bytes_read += copied;
+		return copied;
+	}
+
+	if (sf->rx_eof) {
+		return 0;
+	}
+
+	kernel->read_stats.empty_reads++;
+	errno = EWOULDBLOCK;
+	return -1;
+}
+
+int receive_message(int fd, struct msghdr *msg, int flags) {
+	struct file *f = map_fd(fd);
+	if (f && f->type == FD_TYPE_DATAGRAM) {
+		return datagram_recvmsg((struct datagram_file *) f, msg, flags);
+	}
+	if (f && f->type == FD_TYPE_SOCKET) {
+		return stream_recvmsg((struct socket_file *) f, msg);
+	}
+
+	errno = f ? ENOTSOCK : EBADF;
+	return -1;
+}
+
+extern ssize_t __real_recvmsg(int sockfd, struct msghdr *msg, int flags);
+ssize_t __wrap_recvmsg(int sockfd, struct msghdr *msg, int flags) {
+	if (sockfd < RESERVED_SYSTEM_FDS) {
+		return __real_recvmsg(sockfd, msg, flags);
+	}
+
+	int received = receive_message(sockfd, msg, flags);
+	return TRACE(TRACE_RECVMSG, sockfd, iovec_length(msg->msg_iov, msg->msg_iovlen), flags, received);
+}
+
+/* As many messages as are queued, up to vlen. How many are queued is up to fuzz data */
+extern int __real_recvmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags, struct timespec *timeout);
+int __wrap_recvmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags, struct timespec *timeout) {
+	if (sockfd < RESERVED_SYSTEM_FDS) {
+		return __real_recvmmsg(sockfd, msgvec, vlen, flags, timeout);
+	}
+
+	unsigned int received = 0;
+	for (; received < vlen; received++) {
+		int length = receive_message(sockfd, &msgvec[received].msg_hdr, flags & ~MSG_WAITFORONE);
+		if (length == -1) {
+			break;
+		}
+		msgvec[received].msg_len = length;
+	}
+
+	COVER(COVER_MESSAGE_BATCH, log2_bucket(received));
+	if (!received) {
+		return TRACE(TRACE_RECVMMSG, sockfd, vlen, flags, -1);
+	}
+	errno = 0;
+	return TRACE(TRACE_RECVMMSG, sockfd, vlen, flags, received);
+}
+
+/* Fuzz data decides how many of the messages the socket takes, none of them failing with EAGAIN */
+extern int __real_sendmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags);
+int __wrap_sendmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags) {
+	if (sockfd < RESERVED_SYSTEM_FDS) {
+		return __real_sendmmsg(sockfd, msgvec, vlen, flags);
+	}
+
+	struct datagram_file *df = (struct datagram_file *) map_fd(sockfd);
+	if (!df || df->base.type != FD_TYPE_DATAGRAM) {
+		errno = df ? EOPNOTSUPP : EBADF;
+		return TRACE(TRACE_SENDMMSG, sockfd, vlen, flags, -1);
+	}
+
+	unsigned int accepted = vlen;
+	unsigned char b;
+	if (vlen && !consume_byte(&b)) {
+		RECORD(RECORD_DECISION, input_offset() - 1);
+		accepted = b % (vlen + 1);
+	}
+	if (vlen && !accepted) {
+		errno = EAGAIN;
+		return TRACE(TRACE_SENDMMSG, sockfd, vlen, flags, -1);
+	}
+
+	/* A message that fails ends the batch, and fails the call if it was the first */
+	unsigned int sent = 0;
+	for (; sent < accepted; sent++) {
+		const struct msghdr *msg = &msgvec[sent].msg_hdr;
+		int length = datagram_send(iovec_length(msg->msg_iov, msg->msg_iovlen), message_gso_size(df, msg));
+		if (length == -1) {
+			break;
+		}
+		msgvec[sent].msg_len = length;
+	}
+
+	COVER(COVER_MESSAGE_BATCH, log2_bucket(sent));
+	if (!sent && vlen) {
+		return TRACE(TRACE_SENDMMSG, sockfd, vlen, flags, -1);
+	}
+	errno = 0;
+	return TRACE(TRACE_SENDMMSG, sockfd, vlen, flags, sent);
+}
+
+extern ssize_t __real_read(int fd, void *buf, size_t count);
+ssize_t __wrap_read(int fd, void *buf, size_t count) {
+
+	if (fd < RESERVED_SYSTEM_FDS) {
+		return __real_read(fd, buf, count);
+	}
+
+	/* Let's try and clear the buffer first */
+	//memset(buf, 0, count);
+
+	struct file *f = map_fd(fd);
+	if (!f) {
+		return TRACE(TRACE_READ, fd, count, 0, -1);
+	}
+
+	errno = 0;
+
+	if (f->type == FD_TYPE_SOCKET) {
+		struct socket_file *sf = (struct socket_file *) f;
+		kernel->read_stats.reads++;
+
+		if (sf->so_error) {
+			errno = sf->so_error;
+			sf->so_error = 0;
+			return TRACE(TRACE_READ, fd, count, 0, -1);
+		}
+
+		/* Reads drain the receive queue, possibly only partially */
+		if (sf->rx_length) {
+			int data_available = count < (size_t) sf->rx_length ? (int) count : sf->rx_length;
+			memcpy(buf, sf->rx_data, data_available);
+
+			sf->rx_data += data_available;
+			sf->rx_length -= data_available;
+			set_readable(sf, sf->rx_length || sf->rx_eof);
+
+			kernel->read_stats.bytes_read += data_available;
+			return TRACE(TRACE_READ, fd, count, 0, data_available);
+		}
+
+		if (sf->rx_eof) {
+			return TRACE(TRACE_READ, fd, count, 0, 0);
+		}
+
+		kernel->read_stats.empty_reads++;
+		errno = EWOULDBLOCK;
+		return TRACE(TRACE_READ, fd, count, 0, -1);
+	}
+
+	if (f->type == FD_TYPE_EVENT) {
+		return event_read((struct event_file *) f, fd, buf, count);
+	}
+
+	if (f->type == FD_TYPE_DATAGRAM) {
+		struct iovec iov = {buf, count};
+		struct msghdr msg = {};
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		return TRACE(TRACE_READ, fd, count, 0, datagram_recvmsg((struct datagram_file *) f, &msg, 0));
+	}
+
+	if (f->type == FD_TYPE_TIMER) {
+		struct timer_file *tf = (struct timer_file *) f;
+		if (count < sizeof(uint64_t)) {
+			errno = EINVAL;
+			return TRACE(TRACE_READ, fd, count, 0, -1);
+		}
+		if (!tf->expirations) {
+			errno = EAGAIN;
+			return TRACE(TRACE_READ, fd, count, 0, -1);
+		}
+
+		/* Reading returns the number of expirations since last read */
+		memcpy(buf, &tf->expirations, sizeof(uint64_t));
+		clear_expirations(tf);
+		return TRACE(TRACE_READ, fd, count, 0, 8);
+	}
+
+	/* Epoll and io_uring FDs cannot be read */
+	errno = EINVAL;
+	return TRACE(TRACE_READ, fd, count, 0, -1);
+}
+
+/* We just ignore the extra flag here */
+ssize_t __wrap_recv(int sockfd, void *buf, size_t len, int flags) {
+	return __wrap_read(sockfd, buf, len);
+}
+
+/* Going over an audit budget is a performance bug in the target */
+void over_budget(int fd, const char *what, int value, int budget) {
+	kernel->send_stats.over_budget++;
+
+#ifdef SYSCALL_AUDIT
+	if (!kernel->over_budget_reported) {
+		printf("ERROR! Socket %d %s %d, budget is %d!\n", fd, what, value, budget);
+		kernel->over_budget_reported = 1;
+	}
+#ifdef AUDIT_ABORT
+	fuzzer_abort();
+#endif
+#endif
+}
+
+/* Sends what writes have gathered since the last message */
+void flush_message(struct socket_file *sf, int fd) {
+	if (!sf->message_bytes) {
+		return;
+	}
+
+	kernel->send_stats.messages++;
+	kernel->send_stats.message_syscalls += sf->message_syscalls;
+	(void) TRACE(TRACE_MESSAGE, fd, sf->message_syscalls, sf->message_bytes, 0);
+
+	if (sf->message_syscalls > MAX_SYSCALLS_PER_MESSAGE) {
+		over_budget(fd, "took syscalls for one message:", sf->message_syscalls, MAX_SYSCALLS_PER_MESSAGE);
+	}
+
+	if (sf->flush_iteration != kernel->iteration) {
+		sf->flush_iteration = kernel->iteration;
+		sf->iteration_flushes = 0;
+	}
+	if (++sf->iteration_flushes > MAX_FLUSHES_PER_ITERATION) {
+		over_budget(fd, "flushed messages in one iteration:", sf->iteration_flushes, MAX_FLUSHES_PER_ITERATION);
+	}
+
+	sf->message_syscalls = 0;
+	sf->message_bytes = 0;
+}
+
+/* Every kind of write ends up here. Writes fill the send buffer and fail with EWOULDBLOCK
+ * when it is full. This function does not consume any fuzz data */
+int socket_write(int fd, size_t len, int flags, int syscall) {
+
+	struct socket_file *sf = (struct socket_file *) map_fd(fd);
+	if (!sf || sf->base.type != FD_TYPE_SOCKET) {
+		errno = sf ? ENOTSOCK : EBADF;
+		return TRACE(syscall, fd, len, flags, -1);
+	}
+
+	kernel->send_stats.sends++;
+	kernel->iteration_sends++;
+
+	/* Sockets still connecting cannot send, those that failed to connect never will */
+	if (sf->connect_state == CONNECT_PENDING || sf->connect_state == CONNECT_FAILED) {
+		errno = sf->connect_state == CONNECT_PENDING ? EWOULDBLOCK : (sf->so_error ? sf->so_error : EPIPE);
+		sf->so_error = 0;
+		return TRACE(syscall, fd, len, flags, -1);
+	}
+
+	sf->message_syscalls++;
+
+	/* SO_SNDBUF may have shrunk the buffer below what it already holds */
+	size_t room = sf->tx_length >= sf->tx_capacity ? 0 : sf->tx_capacity - sf->tx_length;
+	if (!room) {
+		kernel->send_stats.full_sends++;
+		errno = EWOULDBLOCK;
+		return TRACE(syscall, fd, len, flags, -1);
+	}
+
+	int written = len < room ? (int) len : (int) room;
+	sf->tx_length += written;
+	if (sf->tx_length > sf->tx_peak) {
+		sf->tx_peak = sf->tx_length;
+		if (sf->tx_peak > kernel->send_stats.peak_buffered) {
+			kernel->send_stats.peak_buffered = sf->tx_peak;
+		}
+	}
+
+	kernel->send_stats.partial_sends += (size_t) written < len;
+	kernel->send_stats.bytes_sent += written;
+
+	/* The fill level of the send buffer in sixteenths */
+	COVER(COVER_BACKPRESSURE, sf->tx_length < sf->tx_capacity ? (int) ((long long) sf->tx_length * 15 / sf->tx_capacity) : 15);
+
+	sf->message_bytes += written;
+	if (!sf->corked && !(flags & MSG_MORE)) {
+		flush_message(sf, fd);
+	}
+
+	errno = 0;
+	return TRACE(syscall, fd, len, flags, written);
+}
+
+ssize_t __wrap_send(int sockfd, const void *buf, size_t len, int flags) {
+	return socket_write(sockfd, len, flags, TRACE_SEND);
+}
+
+ssize_t __wrap_sendto(int sockfd, const void *buf, size_t len, int flags,
+	const struct sockaddr *dest_addr, socklen_t addrlen) {
+		struct datagram_file *df = (struct datagram_file *) map_fd(sockfd);
+		if (df && df->base.type == FD_TYPE_DATAGRAM) {
+			return TRACE(TRACE_SEND, sockfd, len, flags, datagram_send(len, df->gso_size));
+		}
+		return __wrap_send(sockfd, buf, len, flags);
+}
+
+extern ssize_t __real_write(int fd, const void *buf, size_t count);
+ssize_t __wrap_write(int fd, const void *buf, size_t count) {
+	if (fd < RESERVED_SYSTEM_FDS) {
+		return __real_write(fd, buf, count);
+	}
+
+	struct file *f = map_fd(fd);
+	if (f && f->type == FD_TYPE_EVENT) {
+		return event_write((struct event_file *) f, fd, buf, count);
+	}
+
+	return socket_write(fd, count, 0, TRACE_WRITE);
+}
+
+extern ssize_t __real_writev(int fd, const struct iovec *iov, int iovcnt);
+ssize_t __wrap_writev(int fd, const struct iovec *iov, int iovcnt) {
+	if (fd < RESERVED_SYSTEM_FDS) {
+		return __real_writev(fd, iov, iovcnt);
+	}
+
+	if (iovcnt < 0 || iovcnt > IOV_MAX) {
+		errno = EINVAL;
+		return TRACE(TRACE_WRITEV, fd, 0, 0, -1);
+	}
+
+	return socket_write(fd, iovec_length(iov, iovcnt), 0, TRACE_WRITEV);
+}
+
+extern ssize_t __real_sendmsg(int sockfd, const struct msghdr *msg, int flags);
+ssize_t __wrap_sendmsg(int sockfd, const struct msghdr *msg, int flags) {
+	if (sockfd < RESERVED_SYSTEM_FDS) {
+		return __real_sendmsg(sockfd, msg, flags);
+	}
+
+	struct datagram_file *df = (struct datagram_file *) map_fd(sockfd);
+	if (df && df->base.type == FD_TYPE_DATAGRAM) {
+		return TRACE(TRACE_SENDMSG, sockfd, iovec_length(msg->msg_iov, msg->msg_iovlen), flags,
+			datagram_send(iovec_length(msg->msg_iov, msg->msg_iovlen), message_gso_size(df, msg)));
+	}
+
+	return socket_write(sockfd, iovec_length(msg->msg_iov, msg->msg_iovlen), flags, TRACE_SENDMSG);
+}
+/* Binding only records the port, for SO_REUSEPORT groups */
+int __wrap_bind(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
+	struct socket_file *sf = (struct socket_file *) map_fd(sockfd);
+	if (sf && sf->base.type == FD_TYPE_SOCKET && addr) {
+		if (addr->sa_family == AF_INET && addrlen >= sizeof(struct sockaddr_in)) {
+			sf->port = ntohs(((const struct sockaddr_in *) addr)->sin_port);
+		} else if (addr->sa_family == AF_INET6 && addrlen >= sizeof(struct sockaddr_in6)) {
+			sf->port = ntohs(((const struct sockaddr_in6 *) addr)->sin6_port);
+		}
+	}
+	return TRACE(TRACE_BIND, sockfd, 0, 0, 0);
+}
+
+/* SO_SNDBUF sizes the send buffer like Linux does. Datagram sockets take it and SO_REUSEPORT too,
+ * but send without buffering and are not sharded */
+extern int __real_setsockopt(int sockfd, int level, int optname, const void *optval, socklen_t optlen);
+int __wrap_setsockopt(int sockfd, int level, int optname, const void *optval, socklen_t optlen) {
+	if (sockfd < RESERVED_SYSTEM_FDS) {
+		return __real_setsockopt(sockfd, level, optname, optval, optlen);
+	}
+
+	if (level == SOL_SOCKET && (optname == SO_SNDBUF || optname == SO_REUSEPORT)) {
+		struct socket_file *sf = (struct socket_file *) map_fd(sockfd);
+		if (!sf || (sf->base.type != FD_TYPE_SOCKET && sf->base.type != FD_TYPE_DATAGRAM) || !optval || optlen < sizeof(int)) {
+			errno = !sf ? EBADF : (sf->base.type != FD_TYPE_SOCKET && sf->base.type != FD_TYPE_DATAGRAM ? ENOTSOCK : EINVAL);
+			return TRACE(TRACE_SETSOCKOPT, sockfd, level, optname, -1);
+		}
+
+		if (sf->base.type == FD_TYPE_SOCKET) {
+			/* Negative sizes are huge, as the kernel compares them unsigned */
+			unsigned int value = *(const unsigned int *) optval;
+			if (optname == SO_SNDBUF) {
+				int size = value < (unsigned int) WMEM_MAX ? (int) value : WMEM_MAX;
+				sf->tx_capacity = size * 2 > MIN_SEND_BUFFER_SIZE ? size * 2 : MIN_SEND_BUFFER_SIZE;
+			} else {
+				sf->reuseport = value != 0;
+			}
+		}
+	}
+
+	/* Datagram sockets split sends by UDP_SEGMENT and coalesce receives with UDP_GRO */
+	if (level == SOL_UDP && (optname == UDP_SEGMENT || optname == UDP_GRO)) {
+		struct datagram_file *df = (struct datagram_file *) map_fd(sockfd);
+		if (!df || df->base.type != FD_TYPE_DATAGRAM || !optval || optlen < sizeof(int)) {
+			errno = !df ? EBADF : (df->base.type != FD_TYPE_DATAGRAM ? ENOPROTOOPT : EINVAL);
+			return TRACE(TRACE_SETSOCKOPT, sockfd, level, optname, -1);
+		}
+
+		int value = *(const int *) optval;
+		if (optname == UDP_SEGMENT) {
+			df->gso_size = value;
+		} else {
+			df->gro = value != 0;
+		}
+	}
+
+	/* Uncorking sends what was held back */
+	if (level == IPPROTO_TCP && optname == TCP_CORK) {
+		struct socket_file *sf = (struct socket_file *) map_fd(sockfd);
+		if (!sf || sf->base.type != FD_TYPE_SOCKET || !optval || optlen < sizeof(int)) {
+			errno = !sf ? EBADF : (sf->base.type != FD_TYPE_SOCKET ? ENOTSOCK : EINVAL);
+			return TRACE(TRACE_SETSOCKOPT, sockfd, level, optname, -1);
+		}
+
+		sf->corked = *(const int *) optval != 0;
+		if (!sf->corked) {
+			flush_message(sf, sockfd);
+		}
+	}
+
+	return TRACE(TRACE_SETSOCKOPT, sockfd, level, optname, 0);
+}
+
+extern int __real_fcntl(int fd, int cmd, ... /* arg */ );
+int __wrap_fcntl(int fd, int cmd, ... /* arg */) {
+	if (fd < RESERVED_SYSTEM_FDS) {
+		va_list args;
+		va_start(args, cmd);
+		int ret = __real_fcntl(fd, cmd, args);
+		va_end(args);
+		return ret;
+	}
+
+	return TRACE(TRACE_FCNTL, fd, cmd, 0, 0);
+}
+
+/* Addrinfo */
+int __wrap_getaddrinfo(const char *node, const char *service,
+                       const struct addrinfo *hints,
+                       struct addrinfo **res) {
+	//printf("Wrapped getaddrinfo\n");
+
+	struct addrinfo default_hints = {};
+
+	if (!hints) {
+		hints = &default_hints;
+	}
+
+	unsigned char b;
+	if (consume_byte(&b)) {
+		return TRACE(TRACE_GETADDRINFO, -1, 0, 0, -1);
+	}
+	RECORD(RECORD_DECISION, input_offset() - 1);
+
+	/* Every mock kernel returns its own result, valid until the next call */
+	struct addrinfo *ai = &kernel->addrinfo_result;
+	ai->ai_flags = hints->ai_flags;
+	ai->ai_socktype = hints->ai_socktype;
+	ai->ai_protocol = hints->ai_protocol;
+
+	if (b > 127) {
+		ai->ai_family = AF_INET;//hints->ai_family;
+	} else {
+		ai->ai_family = AF_INET6;//hints->ai_family;
+	}
+
+	/* This one is for generating the wrong family (maybe invalid?) */
+	if (b == 0) {
+		ai->ai_family = hints->ai_family;
+	}
+
+	ai->ai_next = NULL;
+	ai->ai_canonname = NULL;
+
+	/* The any address with the port asked for, so that binding it records the port */
+	int port = service ? atoi(service) : 0;
+	memset(&kernel->addrinfo_address, 0, sizeof(kernel->addrinfo_address));
+	if (ai->ai_family == AF_INET) {
+		kernel->addrinfo_address.in.sin_family = AF_INET;
+		kernel->addrinfo_address.in.sin_port = htons(port);
+		ai->ai_addrlen = sizeof(struct sockaddr_in);
+	} else {
+		kernel->addrinfo_address.in6.sin6_family = ai->ai_family;
+		kernel->addrinfo_address.in6.sin6_port = htons(port);
+		ai->ai_addrlen = sizeof(struct sockaddr_in6);
+	}
+	ai->ai_addr = (struct sockaddr *) &kernel->addrinfo_address;
+
+	*res = ai;
+	return TRACE(TRACE_GETADDRINFO, -1, ai->ai_family, 0, 0);
+}
+
+int __wrap_freeaddrinfo() {
+	return 0;
+}
+
+/* This one should return the same address as accept4 did produce */
+int __wrap_getpeername(int sockfd, struct sockaddr *addr, socklen_t *addrlen) {
+
+	struct file *f = map_fd(sockfd);
+	if (!f) {
+		return TRACE(TRACE_GETPEERNAME, sockfd, 0, 0, -1);
+	}
+
+	// todo: this could fail with -1 also (consume a byte)?
+
+	if (f->type == FD_TYPE_SOCKET) {
+
+		struct socket_file *sf = (struct socket_file *) f;
+
+		if (addr) {
+			memcpy(addr, &sf->addr, sf->len);
+			*addrlen = sf->len;
+		}
+
+		return TRACE(TRACE_GETPEERNAME, sockfd, 0, 0, 0);
+	}
+
+	return TRACE(TRACE_GETPEERNAME, sockfd, 0, 0, -1);
+}
+
+/* Opens the socket of a new connection from an ipv4 or ipv6 peer, or returns -1.
+ * The address is truncated to *addrlen, which is set to its full length */
+int accept_connection(int ipv4, struct sockaddr *addr, socklen_t *addrlen) {
+	int fd = create_fd(1);
+
+	/* Allocate the file */
+	struct socket_file *sf = (struct socket_file *) alloc_file(&fd, &kernel->socket_pool, sizeof(struct socket_file));
+	if (sf) {
+
+		/* Init the file */
+		init_socket_file(sf);
+		sf->connect_state = CONNECT_DONE;
+
+		/* Here we need to create a socket FD and return */
+		init_fd(fd, FD_TYPE_SOCKET, (struct file *)sf);
+#ifdef CONNECTION_MEMORY
+		charge_memory_to(fd, (struct file *) sf);
+#endif
+
+		/* We need to provide an addr */
+
+		/* Begin by setting it to an empty in6 address */
+		memset(&sf->addr, 0, sizeof(struct sockaddr_in6));
+		sf->len = sizeof(struct sockaddr_in6);
+		sf->addr.in6.sin6_family = AF_INET6;
+
+		/* Opt-in to ipv4 */
+		if (ipv4) {
+			memset(&sf->addr, 0, sizeof(struct sockaddr_in6));
+			sf->len = sizeof(struct sockaddr_in);
+			sf->addr.in.sin_family = AF_INET;
+		}
+
+		if (addr && addrlen) {
+			/* Copy from socket to addr */
+			memcpy(addr, &sf->addr, *addrlen < sf->len ? *addrlen : sf->len);
+			*addrlen = sf->len;
+		}
+	}
+	return fd;
+}
+
+/* Accepts a connection from a listener. A connection sharded onto a SO_REUSEPORT member only leaves
+ * its queue once accepted, and under RESOURCE_PRESSURE one that fails for lack of FDs or memory stays queued */
+int accept_from(struct socket_file *listener, int ipv4, struct sockaddr *addr, socklen_t *addrlen) {
+	int fd = accept_connection(ipv4, addr, addrlen);
+	if (listener && listener->base.type == FD_TYPE_SOCKET) {
+		if (fd != -1 && listener->reuseport_next) {
+			listener->incoming--;
+		}
+#ifdef RESOURCE_PRESSURE
+		if (fd == -1 && !listener->reuseport_next) {
+			listener->backlog++;
+		}
+#endif
+	}
+	return fd;
+}
+
+int __wrap_accept4(int sockfd, struct sockaddr *addr, socklen_t *addrlen) {
+	/* We must end with -1 since we are called in a loop */
+
+	/* Members of a SO_REUSEPORT group only accept what was queued on them */
+	struct socket_file *listener = (struct socket_file *) map_fd(sockfd);
+	if (listener && listener->base.type == FD_TYPE_SOCKET && listener->reuseport_next) {
+		if (!listener->incoming) {
+			errno = EAGAIN;
+			return TRACE(TRACE_ACCEPT4, sockfd, 0, 0, -1);
+		}
+	}
+
+#ifdef LOADGEN_MAIN
+	if (!loadgen_connecting()) {
+		errno = EAGAIN;
+		return TRACE(TRACE_ACCEPT4, sockfd, 0, 0, -1);
+	}
+	int fd = accept_from(listener, 1, addr, addrlen);
+	if (fd != -1) {
+		loadgen_open((struct socket_file *) map_fd(fd));
+	}
+	return TRACE(TRACE_ACCEPT4, sockfd, 0, 0, fd);
+#endif
+
+#ifdef RESOURCE_PRESSURE
+	/* What a failed accept left queued is accepted first */
+	if (listener && listener->base.type == FD_TYPE_SOCKET && listener->backlog) {
+		listener->backlog--;
+		return TRACE(TRACE_ACCEPT4, sockfd, 0, 0, accept_from(listener, 1, addr, addrlen));
+	}
+#endif
+
+	unsigned char b;
+	if (consume_byte(&b)) {
+		return TRACE(TRACE_ACCEPT4, sockfd, 0, 0, -1);
+	}
+	RECORD(RECORD_DECISION, input_offset() - 1);
+
+	/* This rule might change, anything below 10 is accepted */
+	if (b < 10) {
+		return TRACE(TRACE_ACCEPT4, sockfd, 0, 0, accept_from(listener, b < 5, addr, addrlen));
+	}
+
+	return TRACE(TRACE_ACCEPT4, sockfd, 0, 0, -1);
+}
+
+int __wrap_listen(int sockfd, int backlog) {
+	/* Listen consumes one byte and fails on -1 */
+	unsigned char b;
+	if (consume_byte(&b)) {
+		return TRACE(TRACE_LISTEN, sockfd, 0, 0, -1);
+	}
+	RECORD(RECORD_DECISION, input_offset() - 1);
+
+	if (b) {
+		struct socket_file *sf = (struct socket_file *) map_fd(sockfd);
+		if (sf && sf->base.type == FD_TYPE_SOCKET && !sf->listening) {
+			sf->listening = 1;
+			if (sf->reuseport && sf->port) {
+				join_reuseport_group(sf);
+			}
+		}
+		return TRACE(TRACE_LISTEN, sockfd, 0, 0, 0);
+	}
+
+	return TRACE(TRACE_LISTEN, sockfd, 0, 0, -1);
+}
+
+/* This one is similar to accept4 and has to return a valid FD of type socket */
+int __wrap_socket(int domain, int type, int protocol) {
+
+	/* Only accept valid families */
+	if (domain != AF_INET && domain != AF_INET6) {
+		return TRACE(TRACE_SOCKET, -1, domain, type, -1);
+	}
+
+	int datagram = (type & ~(SOCK_NONBLOCK | SOCK_CLOEXEC)) == SOCK_DGRAM;
+	int fd = create_fd(!datagram);
+
+	if (datagram) {
+		struct datagram_file *df = (struct datagram_file *) alloc_file(&fd, &kernel->datagram_pool, sizeof(struct datagram_file));
+		if (df) {
+			init_datagram_file(df, domain);
+			init_fd(fd, FD_TYPE_DATAGRAM, (struct file *)df);
+		}
+	} else {
+		struct socket_file *sf = (struct socket_file *) alloc_file(&fd, &kernel->socket_pool, sizeof(struct socket_file));
+		if (sf) {
+			/* Init the file */
+			init_socket_file(sf);
+
+			init_fd(fd, FD_TYPE_SOCKET, (struct file *)sf);
+#ifdef CONNECTION_MEMORY
+			charge_memory_to(fd, (struct file *) sf);
+#endif
+		}
+	}
+
+	return TRACE(TRACE_SOCKET, -1, domain, type, fd);
+}
+
+int __wrap_shutdown() {
+	//printf("Wrapped shutdown\n");
+	return TRACE(TRACE_SHUTDOWN, -1, 0, 0, 0);
+}
+
+/* Connects never complete right away, the outcome is reported by epoll_wait as fuzz data decides */
+extern int __real_connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen);
+int __wrap_connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
+	if (sockfd < RESERVED_SYSTEM_FDS) {
+		return __real_connect(sockfd, addr, addrlen);
+	}
+
+	struct file *f = map_fd(sockfd);
+	if (!f || (f->type != FD_TYPE_SOCKET && f->type != FD_TYPE_DATAGRAM)) {
+		errno = f ? ENOTSOCK : EBADF;
+		return TRACE(TRACE_CONNECT, sockfd, addr ? addr->sa_family : 0, 0, -1);
+	}
+
+	/* Datagram sockets only remember their peer */
+	if (f->type == FD_TYPE_DATAGRAM) {
+		return TRACE(TRACE_CONNECT, sockfd, addr ? addr->sa_family : 0, 0, 0);
+	}
+
+	struct socket_file *sf = (struct socket_file *) f;
+	if (sf->listening || sf->connect_state != CONNECT_NONE || !addr || addrlen > sizeof(sf->addr)) {
+		errno = sf->connect_state == CONNECT_PENDING ? EALREADY : (sf->connect_state == CONNECT_DONE ? EISCONN : EINVAL);
+		return TRACE(TRACE_CONNECT, sockfd, addr ? addr->sa_family : 0, 0, -1);
+	}
+
+	memcpy(&sf->addr, addr, addrlen);
+	sf->len = addrlen;
+	sf->connect_state = CONNECT_PENDING;
+
+	errno = EINPROGRESS;
+	return TRACE(TRACE_CONNECT, sockfd, addr->sa_family, 0, -1);
+}
+
+/* Only SO_ERROR is mocked, reading it clears it */
+extern int __real_getsockopt(int sockfd, int level, int optname, void *optval, socklen_t *optlen);
+int __wrap_getsockopt(int sockfd, int level, int optname, void *optval, socklen_t *optlen) {
+	if (sockfd < RESERVED_SYSTEM_FDS) {
+		return __real_getsockopt(sockfd, level, optname, optval, optlen);
+	}
+
+	struct file *f = map_fd(sockfd);
+	if (!f || (f->type != FD_TYPE_SOCKET && f->type != FD_TYPE_DATAGRAM)) {
+		errno = f ? ENOTSOCK : EBADF;
+		return TRACE(TRACE_GETSOCKOPT, sockfd, level, optname, -1);
+	}
+
+	if (level != SOL_SOCKET || optname != SO_ERROR) {
+		errno = ENOPROTOOPT;
+		return TRACE(TRACE_GETSOCKOPT, sockfd, level, optname, -1);
+	}
+	if (!optval || !optlen || *optlen < sizeof(int)) {
+		errno = EINVAL;
+		return TRACE(TRACE_GETSOCKOPT, sockfd, level, optname, -1);
+	}
+
+	int error = 0;
+	if (f->type == FD_TYPE_SOCKET) {
+		error = ((struct socket_file *) f)->so_error;
+		((struct socket_file *) f)->so_error = 0;
+	}
+	memcpy(optval, &error, sizeof(int));
+	*optlen = sizeof(int);
+	return TRACE(TRACE_GETSOCKOPT, sockfd, level, optname, 0);
+}
+
+/* The timerfd syscalls */
+
+int __wrap_timerfd_create(int clockid, int flags) {
+
+	int fd = create_fd(0);
+	struct timer_file *tf = (struct timer_file *) alloc_file(&fd, &kernel->timer_pool, sizeof(struct timer_file));
+
+	if (tf) {
+
+		/* Init the file, disarmed */
+		tf->expiration = 0;
+		tf->interval = 0;
+		tf->expirations = 0;
+		tf->heap_index = -1;
+		tf->pending_index = -1;
+
+		init_fd(fd, FD_TYPE_TIMER, (struct file *)tf);
+
+	}
+
+	return TRACE(TRACE_TIMERFD_CREATE, -1, clockid, flags, fd);
+}
+
+/* Time left until expiration and the interval, as seen by the virtual clock */
+void get_timer(struct timer_file *tf, struct itimerspec *value) {
+	value->it_interval = ns_to_timespec(tf->interval);
+	value->it_value = ns_to_timespec(tf->heap_index == -1 ? 0 : tf->expiration - kernel->virtual_clock);
+}
+
+/* This function is O(log n) and does not consume any fuzz data */
+int __wrap_timerfd_settime(int fd, int flags,
+                    const struct itimerspec *new_value,
+                    struct itimerspec *old_value) {
+	struct timer_file *tf = (struct timer_file *) map_fd(fd);
+	if (!tf || tf->base.type != FD_TYPE_TIMER || !new_value) {
+		errno = tf && new_value ? EINVAL : (tf ? EFAULT : EBADF);
+		return TRACE(TRACE_TIMERFD_SETTIME, fd, flags, 0, -1);
+	}
+
+	if (old_value) {
+		get_timer(tf, old_value);
+	}
+
+	/* Rearming discards expirations not yet read */
+	clear_expirations(tf);
+
+	uint64_t value = timespec_to_ns(&new_value->it_value);
+	if (!value) {
+		disarm_timer(tf);
+	} else {
+		if (!(flags & TFD_TIMER_ABSTIME)) {
+			value += kernel->virtual_clock;
+		}
+		arm_timer(tf, value, timespec_to_ns(&new_value->it_interval));
+	}
+
+	return TRACE(TRACE_TIMERFD_SETTIME, fd, flags, timespec_to_ns(&new_value->it_value), 0);
+}
+
+int __wrap_timerfd_gettime(int fd, struct itimerspec *curr_value) {
+	struct timer_file *tf = (struct timer_file *) map_fd(fd);
+	if (!tf || tf->base.type != FD_TYPE_TIMER) {
+		errno = tf ? EINVAL : EBADF;
+		return TRACE(TRACE_TIMERFD_GETTIME, fd, 0, 0, -1);
+	}
+
+	get_timer(tf, curr_value);
+	return TRACE(TRACE_TIMERFD_GETTIME, fd, timespec_to_ns(&curr_value->it_value), 0, 0);
+}
+
+/* The eventfd syscalls */
+
+struct event_file {
+	struct file base;
+
+	/* Writes add to the counter and reads take it, or one of it for EFD_SEMAPHORE */
+	uint64_t counter;
+	int semaphore;
+};
+
+/* Another thread writing the counter is what fuzz data gives as EPOLLIN,
+ * this is how wakeups from other event loops are exercised */
+int event_events(struct epoll_interest *ei, int fuzz_events, int *edge_events) {
+	struct event_file *ef = (struct event_file *) ei->f;
+	if ((fuzz_events & ei->epev.events & EPOLLIN) && ef->counter < UINT64_MAX - 1) {
+		ef->counter++;
+		signal_edge((struct file *) ef, EPOLLIN);
+	}
+
+	*edge_events = fuzz_events & ~EPOLLIN & ei->epev.events;
+	return (*edge_events | (ef->counter ? EPOLLIN : 0)) & ei->epev.events;
+}
+
+int event_read(struct event_file *ef, int fd, void *buf, size_t count) {
+	if (count < sizeof(uint64_t)) {
+		errno = EINVAL;
+		return TRACE(TRACE_READ, fd, count, 0, -1);
+	}
+	if (!ef->counter) {
+		errno = EAGAIN;
+		return TRACE(TRACE_READ, fd, count, 0, -1);
+	}
+
+	uint64_t value = ef->semaphore ? 1 : ef->counter;
+	ef->counter -= value;
+	memcpy(buf, &value, sizeof(uint64_t));
+	return TRACE(TRACE_READ, fd, count, 0, sizeof(uint64_t));
+}
+
+int event_write(struct event_file *ef, int fd, const void *buf, size_t count) {
+	uint64_t value;
+	if (count < sizeof(uint64_t) || (memcpy(&value, buf, sizeof(uint64_t)), value == UINT64_MAX)) {
+		errno = EINVAL;
+		return TRACE(TRACE_WRITE, fd, count, 0, -1);
+	}
+
+	/* We never block, a write that would overflow the counter fails like a non-blocking one */
+	if (value > UINT64_MAX - 1 - ef->counter) {
+		errno = EAGAIN;
+		return TRACE(TRACE_WRITE, fd, count, 0, -1);
+	}
+
+	if (value) {
+		ef->counter += value;
+		signal_edge((struct file *) ef, EPOLLIN);
+	}
+	return TRACE(TRACE_WRITE, fd, count, 0, sizeof(uint64_t));
+}
+
+int __wrap_eventfd(unsigned int initval, int flags) {
+
+	int fd = create_fd(0);
+	struct event_file *ef = (struct event_file *) alloc_file(&fd, &kernel->event_pool, sizeof(struct event_file));
+
+	if (ef) {
+
+		/* Init the file */
+		ef->counter = initval;
+		ef->semaphore = (flags & EFD_SEMAPHORE) != 0;
+
+		init_fd(fd, FD_TYPE_EVENT, (struct file *)ef);
+
+		//printf("eventfd: %d\n", fd);
+	}
+
+	return TRACE(TRACE_EVENTFD, -1, 0, 0, fd);
+}
+
+/* The io_uring syscalls. Only targets making these syscalls themselves are mocked: liburing makes them
+ * through its internal __sys_io_uring_* functions, which --wrap cannot intercept, so a target set up with
+ * io_uring_queue_init and friends reaches the real kernel */
+
+/* Both rings are sized to a power of two of at most this many entries */
+const unsigned int URING_MAX_ENTRIES = 4096;
+
+/* A submitted operation, waiting for fuzz data to complete it */
+struct uring_op {
+	int opcode;
+	int fd;
+	uint64_t user_data;
+	uint64_t addr;
+	uint32_t len;
+	int msg_flags;
+
+	/* Accept reads and writes the length of its address here */
+	uint64_t addr2;
+
+	/* Closing the FD cancels the op, even if the number is reused before it completes */
+	unsigned int generation;
+
+	/* Multishot accept and poll stay submitted after they complete */
+	int multishot;
+
+	/* Timeouts expire on the virtual clock, or after count other completions */
+	uint64_t deadline;
+	uint32_t count;
+};
+
+struct uring_file {
+	struct file base;
+
+	/* The SQ and CQ rings share one mapping, the SQEs have their own */
+	struct io_uring_params params;
+	unsigned char *rings;
+	size_t rings_size;
+	struct io_uring_sqe *sqes;
+
+	/* Submitted operations, never more than fit the CQ */
+	struct uring_op *ops;
+	int num_ops;
+
+	/* Completions that did not fit the CQ are held back like IORING_FEAT_NODROP does */
+	struct io_uring_cqe *backlog;
+	int num_backlog;
+
+	/* Completions also count up this eventfd, -1 if none is registered */
+	int eventfd;
+
+	/* In the list of open io_uring files of the kernel */
+	struct uring_file *prev_uring, *next_uring;
+};
+
+extern void *__real_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
+extern int __real_munmap(void *addr, size_t length);
+
+uint32_t *ring_word(struct uring_file *uf, uint32_t offset) {
+	return (uint32_t *) (uf->rings + offset);
+}
+
+void release_uring(struct uring_file *uf) {
+	if (uf->prev_uring) {
+		uf->prev_uring->next_uring = uf->next_uring;
+	} else {
+		kernel->urings = uf->next_uring;
+	}
+	if (uf->next_uring) {
+		uf->next_uring->prev_uring = uf->prev_uring;
+	}
+
+	__real_munmap(uf->rings, uf->rings_size);
+	__real_munmap(uf->sqes, uf->params.sq_entries * sizeof(struct io_uring_sqe));
+	free(uf->ops);
+	free(uf->backlog);
+}
+
+unsigned int round_up_pow2(unsigned int n) {
+	unsigned int pow2 = 1;
+	while (pow2 < n) {
+		pow2 <<= 1;
+	}
+	return pow2;
+}
+
+/* These take the names of liburing's syscall wrappers and so return -errno like they do, errno is set too */
+int uring_error(int error) {
+	errno = error;
+	return -error;
+}
+
+int __wrap_io_uring_setup(unsigned int entries, struct io_uring_params *p) {
+	if (!p || !entries || (p->flags & ~(IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP))) {
+		return TRACE(TRACE_IO_URING_SETUP, -1, entries, p ? p->flags : 0, uring_error(EINVAL));
+	}
+
+	unsigned int cq_entries = 2 * entries;
+	if (p->flags & IORING_SETUP_CQSIZE) {
+		cq_entries = p->cq_entries;
+	}
+	if (p->flags & IORING_SETUP_CLAMP) {
+		entries = entries < URING_MAX_ENTRIES ? entries : URING_MAX_ENTRIES;
+		cq_entries = cq_entries < 2 * URING_MAX_ENTRIES ? cq_entries : 2 * URING_MAX_ENTRIES;
+	}
+	if (entries > URING_MAX_ENTRIES || cq_entries < entries || cq_entries > 2 * URING_MAX_ENTRIES) {
+		return TRACE(TRACE_IO_URING_SETUP, -1, entries, p->flags, uring_error(EINVAL));
+	}
+	entries = round_up_pow2(entries);
+	cq_entries = round_up_pow2(cq_entries);
+
+	int fd = create_fd(0);
+	struct uring_file *uf = (struct uring_file *) alloc_file(&fd, &kernel->uring_pool, sizeof(struct uring_file));
+
+	if (uf) {
+		uf->prev_uring = NULL;
+		uf->next_uring = kernel->urings;
+		if (kernel->urings) {
+			kernel->urings->prev_uring = uf;
+		}
+		kernel->urings = uf;
+
+
+		/* The SQ ring, the SQ array, then the CQ ring and its CQEs */
+		memset(&p->sq_off, 0, sizeof(p->sq_off));
+		memset(&p->cq_off, 0, sizeof(p->cq_off));
+		p->sq_entries = entries;
+		p->cq_entries = cq_entries;
+		p->features = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_SUBMIT_STABLE;
+
+		p->sq_off.head = 0;
+		p->sq_off.tail = 4;
+		p->sq_off.ring_mask = 8;
+		p->sq_off.ring_entries = 12;
+		p->sq_off.flags = 16;
+		p->sq_off.dropped = 20;
+		p->sq_off.array = 24;
+
+		uint32_t cq_ring = (p->sq_off.array + entries * sizeof(uint32_t) + 7) & ~7u;
+		p->cq_off.head = cq_ring;
+		p->cq_off.tail = cq_ring + 4;
+		p->cq_off.ring_mask = cq_ring + 8;
+		p->cq_off.ring_entries = cq_ring + 12;
+		p->cq_off.overflow = cq_ring + 16;
+		p->cq_off.flags = cq_ring + 20;
+		p->cq_off.cqes = cq_ring + 24;
+
+		uf->params = *p;
+		uf->rings_size = p->cq_off.cqes + cq_entries * sizeof(struct io_uring_cqe);
+		uf->rings = (unsigned char *) __real_mmap(NULL, uf->rings_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		uf->sqes = (struct io_uring_sqe *) __real_mmap(NULL, entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (uf->rings == MAP_FAILED || uf->sqes == MAP_FAILED) {
+			printf("ERROR! Cannot map io_uring rings!\n");
+			fuzzer_abort();
+		}
+
+		*ring_word(uf, p->sq_off.ring_mask) = entries - 1;
+		*ring_word(uf, p->sq_off.ring_entries) = entries;
+		*ring_word(uf, p->cq_off.ring_mask) = cq_entries - 1;
+		*ring_word(uf, p->cq_off.ring_entries) = cq_entries;
+
+		begin_mock_allocation();
+		uf->ops = (struct uring_op *) malloc(cq_entries * sizeof(struct uring_op));
+		uf->num_ops = 0;
+		uf->backlog = (struct io_uring_cqe *) malloc(cq_entries * sizeof(struct io_uring_cqe));
+		end_mock_allocation();
+		uf->num_backlog = 0;
+		uf->eventfd = -1;
+
+		if (uf->ops && uf->backlog) {
+			init_fd(fd, FD_TYPE_URING, (struct file *)uf);
+		} else {
+			release_uring(uf);
+			slab_free(&kernel->uring_pool, uf);
+			release_slot(fd_slot(fd));
+			fd = out_of_resources(ENOMEM);
+		}
+	}
+
+	return TRACE(TRACE_IO_URING_SETUP, -1, entries, p->flags, fd == -1 ? -errno : fd);
+}
+
+/* Mapping an io_uring FD hands out its rings, they stay with the FD until it is closed */
+void *__wrap_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset) {
+	if (fd < RESERVED_SYSTEM_FDS) {
+		return __real_mmap(addr, length, prot, flags, fd, offset);
+	}
+
+	struct uring_file *uf = (struct uring_file *) map_fd(fd);
+	if (!uf || uf->base.type != FD_TYPE_URING) {
+		errno = uf ? ENODEV : EBADF;
+		return MAP_FAILED;
+	}
+
+	if ((offset == (off_t) IORING_OFF_SQ_RING || offset == (off_t) IORING_OFF_CQ_RING) && length <= uf->rings_size) {
+		return uf->rings;
+	}
+	if (offset == (off_t) IORING_OFF_SQES && length <= uf->params.sq_entries * sizeof(struct io_uring_sqe)) {
+		return uf->sqes;
+	}
+
+	errno = EINVAL;
+	return MAP_FAILED;
+}
+
+/* Unmapping rings is left to close, this function is O(open io_urings) */
+int __wrap_munmap(void *addr, size_t length) {
+	for (struct uring_file *uf = kernel->urings; uf; uf = uf->next_uring) {
+		if (addr == uf->rings || addr == uf->sqes) {
+			return 0;
+		}
+	}
+
+	return __real_munmap(addr, length);
+}
+
+/* Posts a CQE, into the backlog if the CQ is full and counted as overflow if that is full too */
+void post_completion(struct uring_file *uf, struct uring_op *op, int res, int flags) {
+	(void) TRACE(TRACE_COMPLETION, op->fd, op->opcode, res, 0);
+
+	struct io_uring_cqe cqe = {};
+	cqe.user_data = op->user_data;
+	cqe.res = res;
+	cqe.flags = flags;
+
+	uint32_t *cq_tail = ring_word(uf, uf->params.cq_off.tail);
+	uint32_t tail = *cq_tail;
+	if (!uf->num_backlog && tail - __atomic_load_n(ring_word(uf, uf->params.cq_off.head), __ATOMIC_ACQUIRE) < uf->params.cq_entries) {
+		((struct io_uring_cqe *) (uf->rings + uf->params.cq_off.cqes))[tail & (uf->params.cq_entries - 1)] = cqe;
+		__atomic_store_n(cq_tail, tail + 1, __ATOMIC_RELEASE);
+	} else if (uf->num_backlog < (int) uf->params.cq_entries) {
+		uf->backlog[uf->num_backlog++] = cqe;
+		__atomic_or_fetch(ring_word(uf, uf->params.sq_off.flags), IORING_SQ_CQ_OVERFLOW, __ATOMIC_RELEASE);
+	} else {
+		(*ring_word(uf, uf->params.cq_off.overflow))++;
+	}
+
+	/* The target may have closed the registered eventfd */
+	struct event_file *ef = (struct event_file *) lookup_fd(uf->eventfd);
+	if (ef && ef->base.type == FD_TYPE_EVENT && ef->counter < UINT64_MAX - 1) {
+		ef->counter++;
+		signal_edge((struct file *) ef, EPOLLIN);
+	}
+}
+
+/* Moves held back completions to the CQ as the target makes room */
+void flush_backlog(struct uring_file *uf) {
+	uint32_t *cq_tail = ring_word(uf, uf->params.cq_off.tail);
+	uint32_t tail = *cq_tail, head = __atomic_load_n(ring_word(uf, uf->params.cq_off.head), __ATOMIC_ACQUIRE);
+
+	int flushed = 0;
+	for (; flushed < uf->num_backlog && tail - head < uf->params.cq_entries; flushed++) {
+		((struct io_uring_cqe *) (uf->rings + uf->params.cq_off.cqes))[tail++ & (uf->params.cq_entries - 1)] = uf->backlog[flushed];
+	}
+	__atomic_store_n(cq_tail, tail, __ATOMIC_RELEASE);
+
+	uf->num_backlog -= flushed;
+	memmove(uf->backlog, uf->backlog + flushed, uf->num_backlog * sizeof(struct io_uring_cqe));
+	if (!uf->num_backlog) {
+		__atomic_and_fetch(ring_word(uf, uf->params.sq_off.flags), ~IORING_SQ_CQ_OVERFLOW, __ATOMIC_RELEASE);
+	}
+}
 
-	*res = &ai;
+/* Timeouts waiting for a number of completions count this one, returns the CQEs this posted */
+int count_completion(struct uring_file *uf) {
+	int posted = 0;
+	for (int i = 0; i < uf->num_ops; i++) {
+		struct uring_op *op = &uf->ops[i];
+		if (op->opcode == IORING_OP_TIMEOUT && op->count && !--op->count) {
+			post_completion(uf, op, 0, 0);
+			uf->ops[i--] = uf->ops[--uf->num_ops];
+			posted++;
+		}
+	}
+	return posted;
+}
+
+/* Completes op i, which stays submitted if it is multishot, returns the CQEs this posted */
+int finish_op(struct uring_file *uf, int i, int res) {
+	struct uring_op *op = &uf->ops[i];
+	int more = op->multishot && res >= 0;
+	int timeout = op->opcode == IORING_OP_TIMEOUT;
+
+	post_completion(uf, op, res, more ? IORING_CQE_F_MORE : 0);
+	if (!more) {
+		uf->ops[i] = uf->ops[--uf->num_ops];
+	}
+	return timeout ? 1 : 1 + count_completion(uf);
+}
+
+/* Operations not mocked complete right away with an error, as do cancellations */
+void submit_op(struct uring_file *uf, const struct io_uring_sqe *sqe) {
+	struct uring_op op = {};
+	op.opcode = sqe->opcode;
+	op.fd = sqe->fd;
+	op.user_data = sqe->user_data;
+	op.addr = sqe->addr;
+	op.addr2 = sqe->addr2;
+	op.len = sqe->len;
+	op.msg_flags = sqe->msg_flags;
+
+	/* Registered files and provided buffers are not mocked */
+	if (sqe->flags & (IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT)) {
+		post_completion(uf, &op, -EINVAL, 0);
+		return;
+	}
+
+	switch (sqe->opcode) {
+	case IORING_OP_NOP:
+		post_completion(uf, &op, 0, 0);
+		return;
+	case IORING_OP_ASYNC_CANCEL:
+		for (int i = 0; i < uf->num_ops; i++) {
+			if (uf->ops[i].user_data == sqe->addr) {
+				post_completion(uf, &uf->ops[i], -ECANCELED, 0);
+				uf->ops[i] = uf->ops[--uf->num_ops];
+				post_completion(uf, &op, 0, 0);
+				return;
+			}
+		}
+		post_completion(uf, &op, -ENOENT, 0);
+		return;
+	case IORING_OP_ACCEPT:
+		op.multishot = (sqe->ioprio & IORING_ACCEPT_MULTISHOT) != 0;
+		break;
+	case IORING_OP_POLL_ADD:
+		op.multishot = (sqe->len & IORING_POLL_ADD_MULTI) != 0;
+		op.len = sqe->poll32_events | EPOLLERR | EPOLLHUP;
+		break;
+	case IORING_OP_RECV:
+		/* Multishot receives need provided buffers */
+		if (sqe->ioprio & IORING_RECV_MULTISHOT) {
+			post_completion(uf, &op, -EINVAL, 0);
+			return;
+		}
+		break;
+	case IORING_OP_SEND:
+		break;
+	case IORING_OP_TIMEOUT: {
+		if (sqe->len != 1 || !sqe->addr) {
+			post_completion(uf, &op, -EINVAL, 0);
+			return;
+		}
+		struct __kernel_timespec ts;
+		memcpy(&ts, (const void *) (uintptr_t) sqe->addr, sizeof(ts));
+		uint64_t ns = ts.tv_sec * 1000000000ull + ts.tv_nsec;
+		op.deadline = (sqe->timeout_flags & IORING_TIMEOUT_ABS) ? ns : kernel->virtual_clock + ns;
+		op.count = (uint32_t) sqe->off;
+		break;
+	}
+	default:
+		post_completion(uf, &op, -EINVAL, 0);
+		return;
+	}
+
+	if (op.opcode != IORING_OP_TIMEOUT) {
+		struct file *f = lookup_fd(op.fd);
+		if (!f) {
+			post_completion(uf, &op, -EBADF, 0);
+			return;
+		}
+		op.generation = f->generation;
+	}
+
+	uf->ops[uf->num_ops++] = op;
+}
+
+/* Consumes SQEs the target has queued, up to to_submit of them and as long as the CQ could take them */
+int submit_ops(struct uring_file *uf, unsigned int to_submit) {
+	uint32_t *sq_head = ring_word(uf, uf->params.sq_off.head);
+	uint32_t head = *sq_head, tail = __atomic_load_n(ring_word(uf, uf->params.sq_off.tail), __ATOMIC_ACQUIRE);
+	uint32_t *sq_array = ring_word(uf, uf->params.sq_off.array);
+
+	int submitted = 0;
+	for (; submitted < (int) to_submit && head != tail; head++) {
+		uint32_t index = sq_array[head & (uf->params.sq_entries - 1)];
+		if (index >= uf->params.sq_entries) {
+			(*ring_word(uf, uf->params.sq_off.dropped))++;
+			continue;
+		}
+		if (uf->num_ops == (int) uf->params.cq_entries) {
+			break;
+		}
+
+		submit_op(uf, &uf->sqes[index]);
+		submitted++;
+	}
+
+	__atomic_store_n(sq_head, head, __ATOMIC_RELEASE);
+	return submitted;
+}
+
+/* Op i is resolved as if the byte fuzz data picked it with had arrived from the peer,
+ * a socket op that still has nothing to do stays submitted. Returns the CQEs this posted */
+int resolve_op(struct uring_file *uf, int i, unsigned char b) {
+	struct uring_op *op = &uf->ops[i];
+
+	/* Time passes until the timeout has expired */
+	if (op->opcode == IORING_OP_TIMEOUT) {
+		if (op->deadline > kernel->virtual_clock) {
+			kernel->virtual_clock = op->deadline;
+			expire_timers();
+		}
+		return finish_op(uf, i, -ETIME);
+	}
+
+	struct file *f = lookup_fd(op->fd);
+	if (!f || f->generation != op->generation) {
+		return finish_op(uf, i, -ECANCELED);
+	}
+#ifdef CONNECTION_MEMORY
+	charge_memory_to(op->fd, f);
+#endif
+
+	/* The byte is the events, like in epoll_wait */
+	if (op->opcode == IORING_OP_POLL_ADD) {
+		int ready_events = b & op->len;
+		if (f->type == FD_TYPE_SOCKET) {
+			struct epoll_interest ei = {};
+			ei.fd = op->fd;
+			ei.type = f->type;
+			ei.epev.events = op->len;
+			ei.f = f;
+			int edge_events;
+			ready_events = socket_events(&ei, b, &edge_events);
+		}
+		return ready_events ? finish_op(uf, i, ready_events) : 0;
+	}
+
+	if (f->type != FD_TYPE_SOCKET) {
+		return finish_op(uf, i, -ENOTSOCK);
+	}
+	struct socket_file *sf = (struct socket_file *) f;
+
+	if (op->opcode == IORING_OP_ACCEPT) {
+		if (!sf->listening) {
+			return finish_op(uf, i, -EINVAL);
+		}
+
+		/* The byte brings a connection, which a SO_REUSEPORT member may have to leave to another */
+		if (sf->reuseport_next && !sf->incoming) {
+			shard_connection(sf);
+			if (!sf->incoming) {
+				return 0;
+			}
+		}
+#ifdef RESOURCE_PRESSURE
+		/* What a failed accept left queued is accepted first */
+		if (sf->backlog) {
+			sf->backlog--;
+		}
+#endif
+		int fd = accept_from(sf, b & 1, (struct sockaddr *) (uintptr_t) op->addr, (socklen_t *) (uintptr_t) op->addr2);
+		return finish_op(uf, i, fd == -1 ? -errno : fd);
+	}
+
+	if (sf->listening) {
+		return finish_op(uf, i, -ENOTCONN);
+	}
+
+	if (op->opcode == IORING_OP_RECV) {
+		if (!sf->rx_length && !sf->rx_eof) {
+			fill_receive_queue(sf, op->fd);
+		}
+
+		if (sf->rx_length) {
+			kernel->read_stats.reads++;
+			int data_available = op->len < (uint32_t) sf->rx_length ? (int) op->len : sf->rx_length;
+			memcpy((void *) (uintptr_t) op->addr, sf->rx_data, data_available);
+
+			sf->rx_data += data_available;
+			sf->rx_length -= data_available;
+			set_readable(sf, sf->rx_length || sf->rx_eof);
+
+			kernel->read_stats.bytes_read += data_available;
+			return finish_op(uf, i, data_available);
+		}
+
+		return sf->rx_eof ? finish_op(uf, i, 0) : 0;
+	}
+
+	/* Sends wait for the peer to make room */
+	if (sf->tx_length >= sf->tx_capacity) {
+		drain_send_buffer(sf, op->fd);
+	}
+	int written = socket_write(op->fd, op->len, op->msg_flags, TRACE_SEND);
+	if (written == -1 && errno == EWOULDBLOCK) {
+		return 0;
+	}
+	return finish_op(uf, i, written == -1 ? -errno : written);
+}
+
+/* Every enter is an event-loop iteration. Fuzz data picks which submitted op completes next, one byte
+ * each, until a byte with the high bit set ends the batch once min_complete have completed */
+int __wrap_io_uring_enter(unsigned int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags, sigset_t *sig) {
+	struct uring_file *uf = (struct uring_file *) map_fd(fd);
+	if (!uf || uf->base.type != FD_TYPE_URING) {
+		return TRACE(TRACE_IO_URING_ENTER, fd, to_submit, min_complete, uring_error(uf ? EOPNOTSUPP : EBADF));
+	}
+
+	begin_iteration();
+	flush_backlog(uf);
+
+	int submitted = submit_ops(uf, to_submit);
+	if (!submitted && to_submit && uf->num_ops == (int) uf->params.cq_entries) {
+		return TRACE(TRACE_IO_URING_ENTER, fd, to_submit, min_complete, uring_error(EBUSY));
+	}
+
+	if (!(flags & IORING_ENTER_GETEVENTS)) {
+		min_complete = 0;
+	}
+
+	if (kernel->consumable_data_length) {
+		count_undrained_sockets();
+		RECORD(RECORD_WAIT, input_offset());
+
+		int completed = 0;
+		while (uf->num_ops && kernel->consumable_data_length) {
+			unsigned char b;
+			consume_byte(&b);
+			RECORD(RECORD_READY, input_offset() - 1);
+
+			if ((b & 0x80) && completed >= (int) min_complete) {
+				break;
+			}
+			completed += resolve_op(uf, (b & 0x7f) % uf->num_ops, b);
+		}
+	} else {
+		if (!kernel->torn_down) {
+			kernel->torn_down = 1;
+			(void) TRACE(TRACE_TEARDOWN, -1, 0, 0, 0);
+			teardown();
+		}
+
+		/* Everything still submitted is cancelled, unless teardown closed the ring */
+		uf = (struct uring_file *) lookup_fd(fd);
+		while (uf && uf->base.type == FD_TYPE_URING && uf->num_ops) {
+			post_completion(uf, &uf->ops[uf->num_ops - 1], -ECANCELED, 0);
+			uf->num_ops--;
+		}
+	}
+
+	return TRACE(TRACE_IO_URING_ENTER, fd, to_submit, min_complete, submitted);
+}
+
+/* Only eventfds can be registered, fixed buffers are accepted but never used */
+int __wrap_io_uring_register(unsigned int fd, unsigned int opcode, void *arg, unsigned int nr_args) {
+	struct uring_file *uf = (struct uring_file *) map_fd(fd);
+	if (!uf || uf->base.type != FD_TYPE_URING) {
+		return TRACE(TRACE_IO_URING_REGISTER, fd, opcode, nr_args, uring_error(uf ? EOPNOTSUPP : EBADF));
+	}
+
+	switch (opcode) {
+	case IORING_REGISTER_EVENTFD:
+	case IORING_REGISTER_EVENTFD_ASYNC:
+		if (!arg || nr_args != 1) {
+			return TRACE(TRACE_IO_URING_REGISTER, fd, opcode, nr_args, uring_error(EINVAL));
+		}
+		if (uf->eventfd != -1) {
+			return TRACE(TRACE_IO_URING_REGISTER, fd, opcode, nr_args, uring_error(EBUSY));
+		}
+		uf->eventfd = *(const int *) arg;
+		return TRACE(TRACE_IO_URING_REGISTER, fd, opcode, nr_args, 0);
+	case IORING_UNREGISTER_EVENTFD:
+		if (uf->eventfd == -1) {
+			return TRACE(TRACE_IO_URING_REGISTER, fd, opcode, nr_args, uring_error(ENXIO));
+		}
+		uf->eventfd = -1;
+		return TRACE(TRACE_IO_URING_REGISTER, fd, opcode, nr_args, 0);
+	case IORING_REGISTER_BUFFERS:
+	case IORING_UNREGISTER_BUFFERS:
+		return TRACE(TRACE_IO_URING_REGISTER, fd, opcode, nr_args, 0);
+	}
+
+	return TRACE(TRACE_IO_URING_REGISTER, fd, opcode, nr_args, uring_error(EINVAL));
+}
+
+// timerfd_settime
+
+/* File descriptors exist in a shared dimension, and has to know its type */
+#ifdef CONNECTION_MEMORY
+/* Charging heap memory to connections */
+
+/* Returns the connection still open on fd with the given id, or NULL */
+struct socket_file *open_connection(int fd, uint64_t connection) {
+	int slot = fd_slot(fd);
+	if (slot == -1 || slot >= kernel->fd_watermark) {
+		return NULL;
+	}
+	struct socket_file *sf = (struct socket_file *) *slot_file(slot);
+	return sf && sf->base.type == FD_TYPE_SOCKET && sf->connection == connection ? sf : NULL;
+}
+
+/* Charges what the target allocates from now on to the socket open on fd, listeners are no connection */
+void charge_memory_to(int fd, struct file *f) {
+	if (f->type == FD_TYPE_SOCKET) {
+		struct socket_file *sf = (struct socket_file *) f;
+		kernel->memory_owner = sf->listening ? -1 : fd;
+		kernel->memory_owner_connection = sf->connection;
+	}
+}
+
+int allocation_home(const volatile void *p) {
+	return (int) ((((uintptr_t) p >> 4) * 0x9e3779b97f4a7c15ull) >> 32) & (kernel->allocations_capacity - 1);
+}
+
+/* Where p is, or would go, in the table which is never more than half full */
+int find_allocation(const volatile void *p) {
+	int i = allocation_home(p);
+	while (kernel->allocations[i].p && kernel->allocations[i].p != p) {
+		i = (i + 1) & (kernel->allocations_capacity - 1);
+	}
+	return i;
+}
+
+/* Doubles the table, which lives outside of the heap so that the hooks never allocate. Returns non-null on error */
+int grow_allocations() {
+	struct allocation *old = kernel->allocations;
+	int old_capacity = kernel->allocations_capacity;
+	int capacity = old_capacity ? old_capacity * 2 : 4096;
+
+	void *table = __real_mmap(NULL, capacity * sizeof(struct allocation), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (table == MAP_FAILED) {
+		return -1;
+	}
+	kernel->allocations = (struct allocation *) table;
+	kernel->allocations_capacity = capacity;
+
+	for (int i = 0; i < old_capacity; i++) {
+		if (old[i].p) {
+			kernel->allocations[find_allocation(old[i].p)] = old[i];
+		}
+	}
+	if (old) {
+		__real_munmap(old, old_capacity * sizeof(struct allocation));
+	}
 	return 0;
 }
 
-int __wrap_freeaddrinfo() {
-	return 0;
+/* Removes entry i, moving back the entries after it which would no longer be found */
+void remove_allocation(int i) {
+	int mask = kernel->allocations_capacity - 1;
+	for (int j = (i + 1) & mask; kernel->allocations[j].p; j = (j + 1) & mask) {
+		int home = allocation_home(kernel->allocations[j].p);
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			kernel->allocations[i] = kernel->allocations[j];
+			i = j;
+		}
+	}
+	kernel->allocations[i].p = NULL;
+	kernel->num_allocations--;
+}
+
+/* The malloc hook, crashes on a connection holding more than MAX_CONNECTION_BYTES */
+void charge_malloc(const volatile void *p, size_t size) {
+	if (!charging_memory || kernel->mock_allocating || !p) {
+		return;
+	}
+
+	struct socket_file *sf = open_connection(kernel->memory_owner, kernel->memory_owner_connection);
+	if (!sf) {
+		return;
+	}
+
+	if (2 * (kernel->num_allocations + 1) > kernel->allocations_capacity && grow_allocations()) {
+		return;
+	}
+	struct allocation *a = &kernel->allocations[find_allocation(p)];
+	if (a->p) {
+		return;
+	}
+	a->p = p;
+	a->size = size;
+	a->fd = kernel->memory_owner;
+	a->connection = sf->connection;
+	kernel->num_allocations++;
+
+	sf->heap_bytes += size;
+	if (sf->heap_bytes > sf->heap_peak) {
+		sf->heap_peak = sf->heap_bytes;
+	}
+
+	if (sf->heap_bytes > MAX_CONNECTION_BYTES) {
+		/* Printing allocates */
+		charging_memory = 0;
+		printf("ERROR! Connection on FD %d holds %zu heap bytes, bound is %llu!\n", a->fd, sf->heap_bytes, (unsigned long long) MAX_CONNECTION_BYTES);
+		fuzzer_abort();
+	}
+}
+
+/* The free hook */
+void charge_free(const volatile void *p) {
+	if (!charging_memory || !kernel->num_allocations) {
+		return;
+	}
+
+	int i = find_allocation(p);
+	struct allocation *a = &kernel->allocations[i];
+	if (!a->p) {
+		return;
+	}
+
+	struct socket_file *sf = open_connection(a->fd, a->connection);
+	if (sf) {
+		sf->heap_bytes -= a->size;
+	} else {
+		kernel->closed_bytes -= a->size;
+	}
+	remove_allocation(i);
+}
+
+/* What a closing connection still holds is charged to closed connections until freed */
+void release_connection_memory(struct socket_file *sf) {
+	if (sf->heap_peak) {
+		struct memory_stats *ms = &kernel->memory_stats;
+		ms->connections++;
+		ms->peak_bytes += sf->heap_peak;
+		if (sf->heap_peak > ms->max_peak_bytes) {
+			ms->max_peak_bytes = sf->heap_peak;
+		}
+	}
+	kernel->closed_bytes += sf->heap_bytes;
+	sf->heap_bytes = 0;
+}
+
+/* Counts inputs that left closed connections holding more than before, once all their sockets closed */
+void end_connection_memory() {
+	kernel->memory_owner = -1;
+	if (kernel->closed_bytes > kernel->input_closed_bytes) {
+		kernel->memory_stats.holding_inputs++;
+	}
+}
+
+void print_memory_stats(FILE *out) {
+	struct memory_stats *ms = &kernel->memory_stats;
+	fprintf(out, "%llu connections allocated, %.1f heap bytes per connection at their peak, at most %zu\n",
+		(unsigned long long) ms->connections, ms->connections ? (double) ms->peak_bytes / ms->connections : 0.0, ms->max_peak_bytes);
+	fprintf(out, "%zu heap bytes still held after close, %llu inputs left more held than they found\n",
+		kernel->closed_bytes, (unsigned long long) ms->holding_inputs);
+}
+#endif
+
+extern int __real_close(int fd);
+int __wrap_close(int fd) {
+
+	if (fd < RESERVED_SYSTEM_FDS) {
+		return __real_close(fd);
+	}
+
+	struct file *f = map_fd(fd);
+
+	if (!f) {
+		return TRACE(TRACE_CLOSE, fd, 0, 0, -1);
+	}
+
+	/* Like the kernel, closing the last reference to a file drops it from every epoll set */
+	forget_registrations(f);
+
+	if (f->type == FD_TYPE_EPOLL) {
+		slab_free(&kernel->epoll_pool, f);
+
+		return TRACE(TRACE_CLOSE, fd, 0, 0, free_fd(fd));
+
+	} else if (f->type == FD_TYPE_TIMER) {
+		disarm_timer((struct timer_file *) f);
+		clear_expirations((struct timer_file *) f);
+		slab_free(&kernel->timer_pool, f);
+
+		return TRACE(TRACE_CLOSE, fd, 0, 0, free_fd(fd));
+	} else if (f->type == FD_TYPE_EVENT) {
+		slab_free(&kernel->event_pool, f);
+
+		return TRACE(TRACE_CLOSE, fd, 0, 0, free_fd(fd));
+	} else if (f->type == FD_TYPE_DATAGRAM) {
+		slab_free(&kernel->datagram_pool, f);
+
+		return TRACE(TRACE_CLOSE, fd, 0, 0, free_fd(fd));
+	} else if (f->type == FD_TYPE_URING) {
+		release_uring((struct uring_file *) f);
+		slab_free(&kernel->uring_pool, f);
+
+		return TRACE(TRACE_CLOSE, fd, 0, 0, free_fd(fd));
+	} else if (f->type == FD_TYPE_SOCKET) {
+		kernel->num_sockets--;
+		if (((struct socket_file *) f)->reuseport_next) {
+			leave_reuseport_group((struct socket_file *) f);
+		}
+		flush_message((struct socket_file *) f, fd);
+#ifdef LOADGEN_MAIN
+		loadgen_close((struct socket_file *) f);
+#endif
+#ifdef CONNECTION_MEMORY
+		release_connection_memory((struct socket_file *) f);
+#endif
+		set_readable((struct socket_file *) f, 0);
+		slab_free(&kernel->socket_pool, f);
+
+		int ret = free_fd(fd);
+
+		//free(-1);
+		return TRACE(TRACE_CLOSE, fd, 0, 0, ret);
+	}
+
+	return TRACE(TRACE_CLOSE, fd, 0, 0, -1);
+}
+
+/* Drops every file still open and releases all mock files in bulk */
+void reset_mock_kernel() {
+	for (int slot = 0; slot < kernel->fd_watermark; slot++) {
+		struct file *f = *slot_file(slot);
+		if (f) {
+			forget_registrations(f);
+			if (f->type == FD_TYPE_URING) {
+				release_uring((struct uring_file *) f);
+			}
+#ifdef CONNECTION_MEMORY
+			if (f->type == FD_TYPE_SOCKET) {
+				release_connection_memory((struct socket_file *) f);
+			}
+#endif
+			*slot_file(slot) = NULL;
+		}
+	}
+	kernel->num_fds = 0;
+	kernel->num_sockets = 0;
+	reset_fds();
+
+	kernel->virtual_clock = 0;
+	kernel->timer_heap_size = 0;
+	kernel->num_pending_timers = 0;
+	kernel->num_readable_sockets = 0;
+
+	slab_reset(&kernel->epoll_pool);
+	slab_reset(&kernel->socket_pool);
+	slab_reset(&kernel->timer_pool);
+	slab_reset(&kernel->event_pool);
+	slab_reset(&kernel->uring_pool);
+	slab_reset(&kernel->datagram_pool);
+}
+
+#ifdef SNAPSHOT_SETUP
+/* Setup is fed its own data so that every input resumes from the same state.
+ * Setup typically only needs listen and getaddrinfo to succeed */
+#ifndef SNAPSHOT_SETUP_DATA
+#define SNAPSHOT_SETUP_DATA "\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff"
+#endif
+
+const size_t SNAPSHOT_STACK_SIZE = 16 * 1024 * 1024;
+
+struct slab_pool *file_pool(int type) {
+	switch (type) {
+		case FD_TYPE_EPOLL: return &kernel->epoll_pool;
+		case FD_TYPE_TIMER: return &kernel->timer_pool;
+		case FD_TYPE_EVENT: return &kernel->event_pool;
+		case FD_TYPE_URING: return &kernel->uring_pool;
+		case FD_TYPE_DATAGRAM: return &kernel->datagram_pool;
+		default: return &kernel->socket_pool;
+	}
+}
+
+/* Switching stacks has to be announced to ASan */
+void switch_context(ucontext_t *from, ucontext_t *to, void *to_stack, size_t to_stack_size) {
+#ifdef FUZZER_ASAN
+	void *fake_stack;
+	__sanitizer_start_switch_fiber(&fake_stack, to_stack, to_stack_size);
+	swapcontext(from, to);
+	__sanitizer_finish_switch_fiber(fake_stack, NULL, NULL);
+#else
+	swapcontext(from, to);
+#endif
+}
+
+void park_target() {
+	switch_context(&kernel->target_context, &kernel->fuzzer_context, (void *) kernel->fuzzer_stack, kernel->fuzzer_stack_size);
+}
+
+int snapshot_taken() {
+	return kernel->snapshot.taken;
+}
+
+void take_snapshot_and_park() {
+	kernel->snapshot.taken = 1;
+	kernel->snapshot.num_fds = kernel->num_fds;
+	kernel->snapshot.num_sockets = kernel->num_sockets;
+	kernel->snapshot.fd_watermark = kernel->fd_watermark;
+	kernel->snapshot.free_slots_head = kernel->free_slots_head;
+	kernel->snapshot.free_slots_tail = kernel->free_slots_tail;
+	kernel->snapshot.free_slots_count = kernel->free_slots_count;
+	kernel->snapshot.fd_generation = (unsigned int *) malloc(kernel->fd_watermark * sizeof(unsigned int) + 1);
+	kernel->snapshot.next_free = (int *) malloc(kernel->fd_watermark * sizeof(int) + 1);
+	for (int slot = 0; slot < kernel->fd_watermark; slot++) {
+		kernel->snapshot.fd_generation[slot] = *slot_generation(slot);
+		kernel->snapshot.next_free[slot] = kernel->fd_pages[slot / FD_PAGE_SLOTS]->next_free[slot % FD_PAGE_SLOTS];
+	}
+	for (int type = 0; type < NUM_FD_TYPES; type++) {
+		kernel->snapshot.pool_carved[type] = file_pool(type)->carved;
+	}
+
+	kernel->snapshot.virtual_clock = kernel->virtual_clock;
+	kernel->snapshot.timer_heap_size = kernel->timer_heap_size;
+	kernel->snapshot.num_pending_timers = kernel->num_pending_timers;
+	kernel->snapshot.timer_heap = (struct timer_file **) malloc(kernel->timer_heap_size * sizeof(struct timer_file *) + 1);
+	kernel->snapshot.pending_timers = (struct timer_file **) malloc(kernel->num_pending_timers * sizeof(struct timer_file *) + 1);
+	memcpy(kernel->snapshot.timer_heap, kernel->timer_heap, kernel->timer_heap_size * sizeof(struct timer_file *));
+	memcpy(kernel->snapshot.pending_timers, kernel->pending_timers, kernel->num_pending_timers * sizeof(struct timer_file *));
+
+	kernel->snapshot.num_readable_sockets = kernel->num_readable_sockets;
+	kernel->snapshot.readable_sockets = (struct socket_file **) malloc(kernel->num_readable_sockets * sizeof(struct socket_file *) + 1);
+	memcpy(kernel->snapshot.readable_sockets, kernel->readable_sockets, kernel->num_readable_sockets * sizeof(struct socket_file *));
+
+	kernel->snapshot_open = (char *) malloc(kernel->max_fds);
+	kernel->snapshot.num_files = 0;
+	kernel->snapshot.files = (struct snapshot_file *) malloc(kernel->num_fds * sizeof(struct snapshot_file));
+	memset(kernel->snapshot_open, 0, kernel->max_fds);
+	for (int slot = 0; slot < kernel->fd_watermark; slot++) {
+		struct file *f = *slot_file(slot);
+		if (f && f->type == FD_TYPE_URING) {
+			printf("ERROR! Setup created io_uring FD %d, rings cannot be snapshotted!\n", slot + fd_base());
+			fuzzer_abort();
+		}
+		if (f) {
+			struct snapshot_file *sf = &kernel->snapshot.files[kernel->snapshot.num_files++];
+			sf->slot = slot;
+			sf->size = file_pool(f->type)->object_size;
+			sf->bytes = (unsigned char *) malloc(sf->size);
+			memcpy(sf->bytes, f, sf->size);
+			sf->registrations = (struct registration *) malloc(f->num_registrations * sizeof(struct registration) + 1);
+			memcpy(sf->registrations, f->registrations, f->num_registrations * sizeof(struct registration));
+			sf->interest = NULL;
+			if (f->type == FD_TYPE_EPOLL) {
+				struct epoll_file *ef = (struct epoll_file *) f;
+				sf->interest = (struct epoll_interest *) malloc(ef->num_interest * sizeof(struct epoll_interest) + 1);
+				memcpy(sf->interest, ef->interest, ef->num_interest * sizeof(struct epoll_interest));
+			}
+			kernel->snapshot_open[slot] = 1;
+		}
+	}
+
+	park_target();
+}
+
+void release_snapshot() {
+	for (int i = 0; i < kernel->snapshot.num_files; i++) {
+		free(kernel->snapshot.files[i].bytes);
+		free(kernel->snapshot.files[i].registrations);
+		free(kernel->snapshot.files[i].interest);
+	}
+	free(kernel->snapshot.files);
+	kernel->snapshot.files = NULL;
+	free(kernel->snapshot.fd_generation);
+	free(kernel->snapshot.next_free);
+	free(kernel->snapshot.timer_heap);
+	free(kernel->snapshot.pending_timers);
+	free(kernel->snapshot.readable_sockets);
+	free(kernel->snapshot_open);
+	kernel->snapshot_open = NULL;
+	kernel->snapshot.num_files = 0;
+	kernel->snapshot.taken = 0;
+}
+
+/* The target has to agree with the snapshot on what is open and how it is polled */
+void verify_snapshot() {
+	if (kernel->num_fds != kernel->snapshot.num_fds) {
+		printf("ERROR! Target holds %d FDs after input, snapshot holds %d!\n", kernel->num_fds, kernel->snapshot.num_fds);
+		fuzzer_abort();
+	}
+
+	for (int i = 0; i < kernel->snapshot.num_files; i++) {
+		struct snapshot_file *sf = &kernel->snapshot.files[i];
+		struct file *f = *slot_file(sf->slot);
+		if (!f || f->generation != kernel->snapshot.fd_generation[sf->slot]) {
+			printf("ERROR! Target closed FD %d which was part of the snapshot!\n", sf->slot + fd_base());
+			fuzzer_abort();
+		}
+
+		if (sf->interest) {
+			struct epoll_file *ef = (struct epoll_file *) f;
+			struct epoll_file *snapshot_ef = (struct epoll_file *) sf->bytes;
+			if (ef->num_interest != snapshot_ef->num_interest) {
+				printf("ERROR! Epoll FD %d polls %d FDs after input, snapshot polls %d!\n", sf->slot + fd_base(), ef->num_interest, snapshot_ef->num_interest);
+				fuzzer_abort();
+			}
+
+			for (int j = 0; j < snapshot_ef->num_interest; j++) {
+				struct epoll_interest *expected = &sf->interest[j];
+				int r = find_registration(expected->f, ef);
+				if (r == -1 || memcmp(&ef->interest[expected->f->registrations[r].index].epev, &expected->epev, sizeof(struct epoll_event))) {
+					printf("ERROR! FD %d is polled differently after input than in the snapshot!\n", expected->fd);
+					fuzzer_abort();
+				}
+			}
+		}
+	}
+}
+
+/* Rolls the kernel back to the snapshot, this function is O(FDs touched) */
+void restore_snapshot() {
+	kernel->num_fds = kernel->snapshot.num_fds;
+	kernel->num_sockets = kernel->snapshot.num_sockets;
+	for (int slot = 0; slot < kernel->fd_watermark; slot++) {
+		int before = slot < kernel->snapshot.fd_watermark;
+		*slot_generation(slot) = before ? kernel->snapshot.fd_generation[slot] : 0;
+		kernel->fd_pages[slot / FD_PAGE_SLOTS]->next_free[slot % FD_PAGE_SLOTS] = before ? kernel->snapshot.next_free[slot] : 0;
+	}
+	kernel->fd_watermark = kernel->snapshot.fd_watermark;
+	kernel->free_slots_head = kernel->snapshot.free_slots_head;
+	kernel->free_slots_tail = kernel->snapshot.free_slots_tail;
+	kernel->free_slots_count = kernel->snapshot.free_slots_count;
+
+	/* Timer files are restored below, along with their heap and pending positions */
+	kernel->virtual_clock = kernel->snapshot.virtual_clock;
+	kernel->timer_heap_size = kernel->snapshot.timer_heap_size;
+	kernel->num_pending_timers = kernel->snapshot.num_pending_timers;
+	memcpy(kernel->timer_heap, kernel->snapshot.timer_heap, kernel->timer_heap_size * sizeof(struct timer_file *));
+	memcpy(kernel->pending_timers, kernel->snapshot.pending_timers, kernel->num_pending_timers * sizeof(struct timer_file *));
+
+	/* Same for sockets and their receive queues */
+	kernel->num_readable_sockets = kernel->snapshot.num_readable_sockets;
+	memcpy(kernel->readable_sockets, kernel->snapshot.readable_sockets, kernel->num_readable_sockets * sizeof(struct socket_file *));
+
+	/* Objects freed before the snapshot are left out, they stay poisoned */
+	for (int type = 0; type < NUM_FD_TYPES; type++) {
+		struct slab_pool *pool = file_pool(type);
+		int touched = (pool->carved + SLAB_OBJECTS_PER_CHUNK - 1) / SLAB_OBJECTS_PER_CHUNK;
+		for (int i = kernel->snapshot.pool_carved[type]; i < touched * SLAB_OBJECTS_PER_CHUNK; i++) {
+			ASAN_POISON_MEMORY_REGION(pool->chunks[i / SLAB_OBJECTS_PER_CHUNK] + (i % SLAB_OBJECTS_PER_CHUNK) * pool->object_size, pool->object_size);
+		}
+		pool->carved = kernel->snapshot.pool_carved[type];
+		pool->free_head = NULL;
+		pool->free_tail = NULL;
+	}
+
+	for (int i = 0; i < kernel->snapshot.num_files; i++) {
+		struct snapshot_file *sf = &kernel->snapshot.files[i];
+		struct file *f = *slot_file(sf->slot);
+
+		/* The registrations and interest arrays may have been reallocated, but never shrink */
+		struct registration *registrations = f->registrations;
+		int registrations_capacity = f->registrations_capacity;
+		if (sf->interest) {
+			struct epoll_file *ef = (struct epoll_file *) f;
+			struct epoll_interest *interest = ef->interest;
+			int capacity = ef->interest_capacity;
+			memcpy(f, sf->bytes, sf->size);
+			ef->interest = interest;
+			ef->interest_capacity = capacity;
+			memcpy(ef->interest, sf->interest, ef->num_interest * sizeof(struct epoll_interest));
+		} else {
+			memcpy(f, sf->bytes, sf->size);
+		}
+		f->registrations = registrations;
+		f->registrations_capacity = registrations_capacity;
+		memcpy(f->registrations, sf->registrations, f->num_registrations * sizeof(struct registration));
+	}
+}
+
+/* Emits error on every socket opened by this input, then rewinds and parks.
+ * Returns the number of events, or 0 once resumed with the next input */
+int snapshot_drain(struct epoll_file *ef, struct epoll_event *events, int maxevents) {
+	int ready_events = teardown_events(ef, events, maxevents);
+	if (!ready_events) {
+		verify_snapshot();
+		restore_snapshot();
+		park_target();
+	}
+
+	return ready_events;
+}
+
+void run_target() {
+#ifdef FUZZER_ASAN
+	__sanitizer_finish_switch_fiber(NULL, &kernel->fuzzer_stack, &kernel->fuzzer_stack_size);
+#endif
+
+	test();
+
+	/* The target left its event-loop by itself, the next input starts over */
+	kernel->target_running = 0;
+
+#ifdef FUZZER_ASAN
+	__sanitizer_start_switch_fiber(NULL, kernel->fuzzer_stack, kernel->fuzzer_stack_size);
+#endif
+}
+
+#ifdef STRUCTURED_MUTATOR
+void remember_records();
+#endif
+
+/* Keeps a copy of the input about to be resumed */
+void remember_input(const uint8_t *data, size_t size) {
+	struct snapshot_input *input = &kernel->history[kernel->history_count++ % SNAPSHOT_HISTORY];
+	if (input->capacity < size) {
+		begin_mock_allocation();
+		unsigned char *grown = (unsigned char *) realloc(input->data, size);
+		end_mock_allocation();
+		if (!grown) {
+			printf("ERROR! Cannot keep the input history!\n");
+			fuzzer_abort();
+		}
+		input->data = grown;
+		input->capacity = size;
+	}
+	if (size) {
+		memcpy(input->data, data, size);
+	}
+	input->size = size;
+}
+
+#ifndef REPLAY_MAIN
+/* Writes the kept inputs to a directory, one file per input in the order they ran, so that
+ * replay_snapshot can resume them one after another like the fuzzer did */
+void dump_input_history() {
+	char dir[256], path[300];
+	const char *env = getenv("EPOLL_FUZZER_HISTORY_DIR");
+	if (env) {
+		snprintf(dir, sizeof(dir), "%s", env);
+	} else {
+		snprintf(dir, sizeof(dir), "epoll_fuzzer_history-%d", (int) getpid());
+	}
+	mkdir(dir, 0755);
+
+	uint64_t first = kernel->history_count > SNAPSHOT_HISTORY ? kernel->history_count - SNAPSHOT_HISTORY : 0;
+	for (uint64_t i = first; i < kernel->history_count; i++) {
+		struct snapshot_input *input = &kernel->history[i % SNAPSHOT_HISTORY];
+		snprintf(path, sizeof(path), "%s/%010llu", dir, (unsigned long long) i);
+		int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd == -1) {
+			return;
+		}
+		ssize_t ignored = write(fd, input->data, input->size);
+		(void) ignored;
+		close(fd);
+	}
+
+	printf("Wrote the last %llu of %llu inputs since setup to %s, replay them in order with replay_snapshot%s\n",
+		(unsigned long long) (kernel->history_count - first), (unsigned long long) kernel->history_count, dir,
+		first ? " (earlier inputs were not kept and may be needed to reproduce)" : "");
 }
+#endif
 
-/* This one should return the same address as accept4 did produce */
-int __wrap_getpeername(int sockfd, struct sockaddr *addr, socklen_t *addrlen) {
+int snapshot_test_one_input(const uint8_t *data, size_t size) {
+	if (!kernel->target_running) {
+		if (kernel->snapshot.taken) {
+			release_snapshot();
+		}
+		kernel->history_count = 0;
 
-	struct file *f = map_fd(sockfd);
-	if (!f) {
-		return -1;
-	}
+		if (!kernel->target_stack) {
+			kernel->target_stack = malloc(SNAPSHOT_STACK_SIZE);
+		}
 
-	// todo: this could fail with -1 also (consume a byte)?
+		getcontext(&kernel->target_context);
+		kernel->target_context.uc_stack.ss_sp = kernel->target_stack;
+		kernel->target_context.uc_stack.ss_size = SNAPSHOT_STACK_SIZE;
+		kernel->target_context.uc_link = &kernel->fuzzer_context;
+		makecontext(&kernel->target_context, run_target, 0);
 
-	if (f->type == FD_TYPE_SOCKET) {
+		/* Run setup up until the first epoll_wait */
+		set_consumable_data((const unsigned char *) SNAPSHOT_SETUP_DATA, sizeof(SNAPSHOT_SETUP_DATA) - 1);
+		kernel->target_running = 1;
+		switch_context(&kernel->fuzzer_context, &kernel->target_context, kernel->target_stack, SNAPSHOT_STACK_SIZE);
 
-		struct socket_file *sf = (struct socket_file *) f;
+		if (!kernel->target_running) {
+			printf("ERROR! Target returned before its first epoll_wait!\n");
+			fuzzer_abort();
+		}
+	}
 
-		if (addr) {
-			memcpy(addr, &sf->addr, sf->len);
-			*addrlen = sf->len;
+	/* Resume the target inside epoll_wait, it parks again when done with this input */
+	remember_input(data, size);
+	begin_input(data, size);
+	switch_context(&kernel->fuzzer_context, &kernel->target_context, kernel->target_stack, SNAPSHOT_STACK_SIZE);
+
+#ifdef STRUCTURED_MUTATOR
+	remember_records();
+#endif
+
+	if (!kernel->target_running) {
+		if (kernel->num_fds) {
+			printf("ERROR! Cannot leave open FDs after test!\n");
 		}
+		reset_mock_kernel();
+	}
+#ifdef CONNECTION_MEMORY
+	end_connection_memory();
+#endif
 
-		return 0;
+	return 0;
+}
+#endif
+
+/* Additional mock kernels */
+
+/* Every kernel takes MAX_FDS FDs, the default kernel takes the first range */
+const int MAX_KERNELS = 64;
+struct mock_kernel *kernels[MAX_KERNELS] = {&default_kernel};
+pthread_mutex_t kernels_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Returns a new empty kernel with FDs of its own, or NULL. Bind it to a thread before use */
+struct mock_kernel *create_mock_kernel() {
+	struct mock_kernel *k = (struct mock_kernel *) calloc(1, sizeof(struct mock_kernel));
+	if (!k) {
+		return NULL;
 	}
 
-	return -1;
+	pthread_mutex_lock(&kernels_mutex);
+	for (int i = 1; i < MAX_KERNELS; i++) {
+		if (!kernels[i]) {
+			kernels[i] = k;
+			k->fd_offset = i * MAX_FDS;
+			pthread_mutex_unlock(&kernels_mutex);
+			return k;
+		}
+	}
+	pthread_mutex_unlock(&kernels_mutex);
+
+	free(k);
+	return NULL;
 }
 
-int __wrap_accept4(int sockfd, struct sockaddr *addr, socklen_t *addrlen) {
-	/* We must end with -1 since we are called in a loop */
+/* Makes every mocked syscall of the calling thread use this kernel, NULL binds the default kernel */
+void bind_mock_kernel(struct mock_kernel *k) {
+	kernel = k ? k : &default_kernel;
+}
 
-	unsigned char b;
-	if (consume_byte(&b)) {
-		return -1;
+/* Closes everything still open in the kernel and frees it. No thread may use it after this */
+void destroy_mock_kernel(struct mock_kernel *k) {
+	if (!k || k == &default_kernel) {
+		return;
 	}
 
-	/* This rule might change, anything below 10 is accepted */
-	if (b < 10) {
+	struct mock_kernel *bound = kernel;
+	kernel = k;
+#ifdef SNAPSHOT_SETUP
+	if (k->snapshot.taken) {
+		release_snapshot();
+	}
+	free(k->target_stack);
+#endif
+	reset_mock_kernel();
+	kernel = bound;
+
+	struct slab_pool *pools[] = {&k->epoll_pool, &k->socket_pool, &k->timer_pool, &k->event_pool, &k->uring_pool, &k->datagram_pool};
+	for (int p = 0; p < NUM_FD_TYPES; p++) {
+		for (int i = 0; i < pools[p]->num_chunks; i++) {
+			ASAN_UNPOISON_MEMORY_REGION(pools[p]->chunks[i], pools[p]->object_size * SLAB_OBJECTS_PER_CHUNK);
+			free(pools[p]->chunks[i]);
+		}
+	}
+	free(k->spare_interest);
+	for (int page = 0; page < FD_PAGES; page++) {
+		free(k->fd_pages[page]);
+	}
+	free(k->timer_heap);
+	free(k->pending_timers);
+	free(k->readable_sockets);
+#ifdef CONNECTION_MEMORY
+	if (k->allocations) {
+		__real_munmap(k->allocations, k->allocations_capacity * sizeof(struct allocation));
+	}
 
-		int fd = allocate_fd();
-		if (fd != -1) {
+	/* A thread still bound to this kernel must not charge to it */
+	if (bound == k) {
+		charging_memory = 0;
+	}
+#endif
 
-			/* Allocate the file */
-			struct socket_file *sf = (struct socket_file *) malloc(sizeof(struct socket_file));
+	pthread_mutex_lock(&kernels_mutex);
+	kernels[k->fd_offset / MAX_FDS] = NULL;
+	pthread_mutex_unlock(&kernels_mutex);
 
-			/* Init the file */
+	free(k);
+}
 
-			/* Here we need to create a socket FD and return */
-			init_fd(fd, FD_TYPE_SOCKET, (struct file *)sf);
+/* Structure-aware mutation */
+
+#ifdef STRUCTURED_MUTATOR
+/* Provided by libFuzzer, but not by the replay driver */
+__attribute__((weak)) size_t LLVMFuzzerMutate(uint8_t *data, size_t size, size_t max_size);
+
+/* Record maps of the most recently executed inputs, by hash of the input. This is where
+ * the mutants libFuzzer has just run are found when it mutates them again. Records depend on
+ * how the target ran, so an input that has dropped out of here is mutated as plain bytes */
+const int RECORD_MAPS = 64;
+struct record_map {
+	uint64_t hash;
+	size_t size;
+	int num_records;
+	struct record *records;
+} record_maps[RECORD_MAPS];
+int next_record_map = 0;
+pthread_mutex_t record_maps_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+uint64_t hash_input(const uint8_t *data, size_t size) {
+	uint64_t hash = 14695981039346656037ull;
+	for (size_t i = 0; i < size; i++) {
+		hash = (hash ^ data[i]) * 1099511628211ull;
+	}
+	return hash;
+}
+
+int record_map_matches(struct record_map *map, uint64_t hash, size_t size) {
+	return map->records && map->size == size && map->hash == hash;
+}
 
-			/* We need to provide an addr */
+/* Copies records into a map, keeping the map as it was on error */
+void fill_record_map(struct record_map *map, uint64_t hash, size_t size, const struct record *from, int num_records) {
+	struct record *records = (struct record *) realloc(map->records, num_records * sizeof(struct record) + 1);
+	if (records) {
+		map->hash = hash;
+		map->size = size;
+		map->num_records = num_records;
+		map->records = records;
+		memcpy(records, from, num_records * sizeof(struct record));
+	}
+}
 
-			/* Begin by setting it to an empty in6 address */
-			memset(&sf->addr, 0, sizeof(struct sockaddr_in6));
-			sf->len = sizeof(struct sockaddr_in6);
-			sf->addr.in6.sin6_family = AF_INET6;
-
-			/* Opt-in to ipv4 */
-			if (b < 5) {
-				memset(&sf->addr, 0, sizeof(struct sockaddr_in6));
-				sf->len = sizeof(struct sockaddr_in);
-				sf->addr.in.sin_family = AF_INET;
-			}
+/* Keeps the records of the input just executed, for when libFuzzer mutates it later */
+void remember_records() {
+	pthread_mutex_lock(&record_maps_mutex);
+	struct record_map *map = &record_maps[next_record_map];
+	next_record_map = (next_record_map + 1) % RECORD_MAPS;
+	fill_record_map(map, hash_input(kernel->consumable_data_start, kernel->consumable_data_total),
+		kernel->consumable_data_total, kernel->records, kernel->num_records);
+	pthread_mutex_unlock(&record_maps_mutex);
+}
 
-			if (addr) {
-				/* Copy from socket to addr */
-				memcpy(addr, &sf->addr, sf->len);
-			}
-		}
+/* Returns the records of an input we have recently executed, or NULL. Only the thread mutating may use it */
+struct record_map *find_records(const uint8_t *data, size_t size) {
+	uint64_t hash = hash_input(data, size);
+	struct record_map *found = NULL;
 
-		return fd;
+	pthread_mutex_lock(&record_maps_mutex);
+	for (int i = 0; !found && i < RECORD_MAPS; i++) {
+		if (record_map_matches(&record_maps[i], hash, size)) {
+			found = &record_maps[i];
+		}
 	}
+	pthread_mutex_unlock(&record_maps_mutex);
+	return found;
+}
 
+/* Returns the index of a random record of the given kind, or -1 */
+int pick_record(struct record_map *map, int kind, unsigned int *seed) {
+	for (int tries = 0; tries < 16; tries++) {
+		int i = rand_r(seed) % map->num_records;
+		if (map->records[i].kind == kind && map->records[i].length) {
+			return i;
+		}
+	}
 	return -1;
 }
 
-int __wrap_listen() {
-	/* Listen consumes one byte and fails on -1 */
-	unsigned char b;
-	if (consume_byte(&b)) {
-		return -1;
+/* Where the iteration of wait record i ends, which is where the next one starts */
+size_t iteration_end(struct record_map *map, int i) {
+	for (i++; i < map->num_records; i++) {
+		if (map->records[i].kind == RECORD_WAIT) {
+			return map->records[i].offset;
+		}
 	}
+	return map->size;
+}
 
-	if (b) {
+/* Mutates a receive payload and resizes it, moving everything after it along */
+size_t mutate_receive(uint8_t *data, size_t size, size_t max_size, struct record *r) {
+	uint8_t payload[255];
+	size_t old_length = r->length - 1;
+	memcpy(payload, data + r->offset + 1, old_length);
+
+	size_t max_length = max_size - (size - old_length) < 255 ? max_size - (size - old_length) : 255;
+	size_t new_length = LLVMFuzzerMutate(payload, old_length, max_length);
+	if (!new_length) {
 		return 0;
 	}
 
-	return -1;
+	size_t tail = r->offset + 1 + old_length;
+	memmove(data + r->offset + 1 + new_length, data + tail, size - tail);
+	memcpy(data + r->offset + 1, payload, new_length);
+	data[r->offset] = new_length;
+	return size - old_length + new_length;
 }
 
-/* This one is similar to accept4 and has to return a valid FD of type socket */
-int __wrap_socket(int domain, int type, int protocol) {
+/* Mutates a record without changing its length */
+size_t mutate_in_place(uint8_t *data, size_t size, struct record *r, unsigned int *seed) {
+	uint8_t *b = data + r->offset + rand_r(seed) % r->length;
+	if (r->kind == RECORD_READY) {
+		/* One of EPOLLIN, EPOLLPRI, EPOLLOUT, EPOLLERR or EPOLLHUP */
+		*b ^= 1 << (rand_r(seed) % 5);
+	} else {
+		*b = rand_r(seed);
+	}
+	return size;
+}
 
-	/* Only accept valid families */
-	if (domain != AF_INET && domain != AF_INET6) {
-		return -1;
+/* Copies the iteration of wait record i right after itself */
+size_t duplicate_iteration(uint8_t *data, size_t size, size_t max_size, struct record_map *map, int i) {
+	size_t begin = map->records[i].offset, end = iteration_end(map, i);
+	if (end == begin || size + (end - begin) > max_size) {
+		return 0;
 	}
 
-	int fd = allocate_fd();
+	memmove(data + end + (end - begin), data + end, size - end);
+	memcpy(data + end, data + begin, end - begin);
+	return size + (end - begin);
+}
 
-	if (fd != -1) {
-		struct socket_file *sf = (struct socket_file *)malloc(sizeof(struct socket_file));
+size_t delete_iteration(uint8_t *data, size_t size, struct record_map *map, int i) {
+	size_t begin = map->records[i].offset, end = iteration_end(map, i);
+	if (end == begin) {
+		return 0;
+	}
 
-		/* Init the file */
+	memmove(data + begin, data + end, size - end);
+	return size - (end - begin);
+}
 
-		init_fd(fd, FD_TYPE_SOCKET, (struct file *)sf);
+size_t LLVMFuzzerCustomMutator(uint8_t *data, size_t size, size_t max_size, unsigned int seed) {
+	struct record_map *map = find_records(data, size);
+
+	/* Plain byte mutations still find what structure cannot */
+	if (!map || !map->num_records || rand_r(&seed) % 4 == 0) {
+		return LLVMFuzzerMutate(data, size, max_size);
 	}
 
-#ifdef PRINTF_DEBUG
-	printf("socket returning fd: %d\n", fd);
-#endif
+	size_t new_size = 0;
+	int i;
+	switch (rand_r(&seed) % 4) {
+	case 0:
+		if ((i = pick_record(map, RECORD_RECEIVE, &seed)) != -1) {
+			new_size = mutate_receive(data, size, max_size, &map->records[i]);
+		}
+		break;
+	case 1:
+		i = rand_r(&seed) % map->num_records;
+		if (map->records[i].length) {
+			new_size = mutate_in_place(data, size, &map->records[i], &seed);
+		}
+		break;
+	case 2:
+		if ((i = pick_record(map, RECORD_WAIT, &seed)) != -1) {
+			new_size = duplicate_iteration(data, size, max_size, map, i);
+		}
+		break;
+	case 3:
+		if ((i = pick_record(map, RECORD_WAIT, &seed)) != -1) {
+			new_size = delete_iteration(data, size, map, i);
+		}
+		break;
+	}
 
-	return fd;
+	return new_size ? new_size : LLVMFuzzerMutate(data, size, max_size);
 }
 
-int __wrap_shutdown() {
-	//printf("Wrapped shutdown\n");
-	return 0;
+/* Where a random iteration starts, or the end of the input */
+size_t pick_iteration(struct record_map *map, unsigned int *seed) {
+	int i = pick_record(map, RECORD_WAIT, seed);
+	return i != -1 ? (size_t) map->records[i].offset : map->size;
 }
 
-/* The timerfd syscalls */
-
-struct timer_file {
-	struct file base;
-};
+/* Continues the iterations of one input with the iterations of another */
+size_t LLVMFuzzerCustomCrossOver(const uint8_t *data1, size_t size1, const uint8_t *data2, size_t size2,
+	uint8_t *out, size_t max_out_size, unsigned int seed) {
+	/* Without the records of both we fail, and libFuzzer picks another mutation */
+	struct record_map *map1 = find_records(data1, size1), *map2 = find_records(data2, size2);
+	if (!map1 || !map2 || !map1->num_records || !map2->num_records) {
+		return 0;
+	}
 
-int __wrap_timerfd_create(int clockid, int flags) {
+	size_t begin1 = pick_iteration(map1, &seed), begin2 = pick_iteration(map2, &seed);
+	if (begin1 > max_out_size) {
+		begin1 = max_out_size;
+	}
+	size_t tail = size2 - begin2 < max_out_size - begin1 ? size2 - begin2 : max_out_size - begin1;
 
-	int fd = allocate_fd();
+	memcpy(out, data1, begin1);
+	memcpy(out + begin1, data2 + begin2, tail);
+	return begin1 + tail;
+}
+#endif
 
-	if (fd != -1) {
-		struct timer_file *tf = (struct timer_file *)malloc(sizeof(struct timer_file));
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+#ifdef SNAPSHOT_SETUP
+	return snapshot_test_one_input(data, size);
+#endif
 
-		/* Init the file */
+	begin_input(data, size);
 
+	test();
 
-		init_fd(fd, FD_TYPE_TIMER, (struct file *)tf);
+#ifdef STRUCTURED_MUTATOR
+	remember_records();
+#endif
 
+	if (kernel->num_fds) {
+		printf("ERROR! Cannot leave open FDs after test!\n");
 	}
 
-#ifdef PRINTF_DEBUG
-	printf("timerfd_create returning fd: %d\n", fd);
+	/* Every input starts from an empty kernel with the same FD numbers */
+	reset_mock_kernel();
+#ifdef CONNECTION_MEMORY
+	end_connection_memory();
 #endif
 
-	return fd;
+	return 0;
 }
 
-int __wrap_timerfd_settime(int fd, int flags,
-                    const struct itimerspec *new_value,
-                    struct itimerspec *old_value) {
-	//printf("timerfd_settime: %d\n", fd);
-	return 0;
+#ifdef __cplusplus
 }
+#endif
 
-/* The eventfd syscalls */
+/* A standalone driver replaying crash inputs, corpora and trace dumps without libFuzzer */
+#ifdef REPLAY_MAIN
+#include <dirent.h>
+#include <sys/stat.h>
 
-struct event_file {
-	struct file base;
-};
+/* What we are replaying, for crash reports */
+const char *replay_file;
 
-int __wrap_eventfd() {
+/* Stepping pauses before every epoll_wait */
+int replay_stepping = 0;
+int replay_iteration;
+#ifdef SYSCALL_TRACE
+uint64_t replay_traced;
+#endif
 
-	int fd = allocate_fd();
+void replay_report() {
+	if (replay_file) {
+		fprintf(stderr, "Crashed while replaying %s\n", replay_file);
+	}
+}
 
-	if (fd != -1) {
-		struct event_file *ef = (struct event_file *)malloc(sizeof(struct event_file));
+void replay_step(int epfd, int num_interest) {
+	replay_iteration++;
+	if (!replay_stepping) {
+		return;
+	}
 
-		/* Init the file */
+#ifdef SYSCALL_TRACE
+	/* Show what happened since the last step */
+	uint64_t first = kernel->trace_count > TRACE_RECORDS ? kernel->trace_count - TRACE_RECORDS : 0;
+	for (uint64_t i = replay_traced > first ? replay_traced : first; i < kernel->trace_count; i++) {
+		print_trace_record(stdout, &kernel->trace_ring[i & (TRACE_RECORDS - 1)]);
+	}
+	replay_traced = kernel->trace_count;
+#endif
 
-		init_fd(fd, FD_TYPE_EVENT, (struct file *)ef);
+	printf("-- epoll_wait #%d on %d polling %d FDs, %d FDs open, %d of %d bytes consumed "
+		"[enter: step, c: continue, q: quit] ", replay_iteration, epfd, num_interest, kernel->num_fds,
+		kernel->consumable_data_total - kernel->consumable_data_length, kernel->consumable_data_total);
+	fflush(stdout);
 
-		//printf("eventfd: %d\n", fd);
+	char line[16];
+	if (!fgets(line, sizeof(line), stdin) || line[0] == 'q') {
+		exit(0);
+	}
+	if (line[0] == 'c') {
+		replay_stepping = 0;
 	}
+}
 
-#ifdef PRINTF_DEBUG
-	printf("eventfd returning fd: %d\n", fd);
-#endif
+/* Replays one file, which is either a raw input or a trace dump holding one */
+int replay_input(const char *path) {
+	FILE *f = fopen(path, "rb");
+	if (!f) {
+		perror(path);
+		return -1;
+	}
 
-	return fd;
+	fseek(f, 0, SEEK_END);
+	long length = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	unsigned char *data = (unsigned char *) malloc(length + 1);
+	if (fread(data, 1, length, f) != (size_t) length) {
+		perror(path);
+		fclose(f);
+		free(data);
+		return -1;
+	}
+	fclose(f);
+
+	unsigned char *input = data;
+	struct trace_header header;
+	if (length >= (long) sizeof(header) && !memcmp(data, TRACE_MAGIC, 4)) {
+		memcpy(&header, data, sizeof(header));
+		long offset = sizeof(header) + header.num_records * sizeof(struct trace_record);
+		if (header.version != TRACE_VERSION || offset + header.input_length != length) {
+			fprintf(stderr, "%s is not a valid version %d trace\n", path, TRACE_VERSION);
+			free(data);
+			return -1;
+		}
+		input += offset;
+		length = header.input_length;
+	}
+
+	replay_file = path;
+	replay_iteration = 0;
+	LLVMFuzzerTestOneInput(input, length);
+	replay_file = NULL;
+
+	free(data);
+	return 0;
 }
 
-// timerfd_settime
+/* Replays a file, or every file in a directory in name order. Returns the number of inputs replayed */
+int replay_path(const char *path) {
+	struct stat st;
+	if (stat(path, &st)) {
+		perror(path);
+		return 0;
+	}
 
-/* File descriptors exist in a shared dimension, and has to know its type */
-extern int __real_close(int fd);
-int __wrap_close(int fd) {
+	if (!S_ISDIR(st.st_mode)) {
+		return replay_input(path) ? 0 : 1;
+	}
 
-	if (fd < RESERVED_SYSTEM_FDS) {
-		return __real_close(fd);
+	struct dirent **entries;
+	int num_entries = scandir(path, &entries, NULL, alphasort);
+	int replayed = 0;
+	for (int i = 0; i < num_entries; i++) {
+		if (entries[i]->d_name[0] != '.') {
+			char *child = (char *) malloc(strlen(path) + strlen(entries[i]->d_name) + 2);
+			sprintf(child, "%s/%s", path, entries[i]->d_name);
+			replayed += replay_path(child);
+			free(child);
+		}
+		free(entries[i]);
 	}
+	free(entries);
+	return replayed;
+}
 
-	struct file *f = map_fd(fd);
+int main(int argc, char **argv) {
+	int num_paths = 0;
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--step")) {
+			replay_stepping = 1;
+		} else {
+			argv[++num_paths] = argv[i];
+		}
+	}
 
-	if (!f) {
-		return -1;
+	if (!num_paths) {
+		fprintf(stderr, "Usage: %s [--step] input|trace|corpus_directory...\n", argv[0]);
+		return 1;
 	}
 
-	if (f->type == FD_TYPE_EPOLL) {
-#ifdef PRINTF_DEBUG
-		printf("Closing epoll FD: %d\n", fd);
-#endif
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
 
-		free(f);
+	int replayed = 0;
+	for (int i = 1; i <= num_paths; i++) {
+		replayed += replay_path(argv[i]);
+	}
 
-		return free_fd(fd);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+	printf("Replayed %d inputs in %.1f ms\n", replayed, ms);
+	print_read_stats(stdout);
+	print_send_stats(stdout);
+#ifdef CONNECTION_MEMORY
+	print_memory_stats(stdout);
+#endif
+#ifdef ITERATION_TIMING
+	print_iteration_histogram(stdout);
+#endif
 
-	} else if (f->type == FD_TYPE_TIMER) {
-#ifdef PRINTF_DEBUG
-		printf("Closing timer fd: %d\n", fd);
+	return 0;
+}
 #endif
 
-		free(f);
+/* A standalone load generator benchmarking the target without a network */
+#ifdef LOADGEN_MAIN
 
-		return free_fd(fd);
-	} else if (f->type == FD_TYPE_EVENT) {
-#ifdef PRINTF_DEBUG
-		printf("Closing event fd: %d\n", fd);
-#endif
+/* The first segment of a WebSocket connection upgrades it */
+const char LOADGEN_UPGRADE[] = "GET / HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+	"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n";
 
-		free(f);
+const char LOADGEN_GET[] = "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n";
 
-		return free_fd(fd);
-	} else if (f->type == FD_TYPE_SOCKET) {
-#ifdef PRINTF_DEBUG
-		printf("Closing socket fd: %d\n", fd);
-#endif
+struct loadgen_workload {
+	int websocket;
+	int connections;
+	int requests;
+	int pipeline;
+	int frame_size;
 
-		// we should call epoll_ctl remove here
+	/* A segment holds pipeline requests back to back, the last one of a connection may hold fewer */
+	unsigned char *batch;
+	int request_length;
 
-		free(f);
+	/* Connections are done once they have sent their EOF, or once the target closed them */
+	int accepted;
+	int finished;
+	uint64_t requests_done;
+} loadgen;
 
-		int ret = free_fd(fd);
+int loadgen_iteration() {
+	return loadgen.finished < loadgen.connections;
+}
 
-#ifdef PRINTF_DEBUG
-		printf("Ret: %d\n", ret);
-#endif
+int loadgen_connecting() {
+	return loadgen.accepted < loadgen.connections;
+}
 
-		//free(-1);
-		return ret;
+void loadgen_open(struct socket_file *sf) {
+	loadgen.accepted++;
+	sf->requests_left = loadgen.requests;
+}
+
+/* Listeners are readable until every connection is accepted, connections always want to send more */
+int loadgen_events(struct epoll_interest *ei) {
+	if (ei->type != FD_TYPE_SOCKET) {
+		return ei->type == FD_TYPE_DATAGRAM ? EPOLLOUT : 0;
 	}
 
-	return -1;
+	struct socket_file *sf = (struct socket_file *) ei->f;
+	if (sf->listening) {
+		return loadgen_connecting() ? EPOLLIN : 0;
+	}
+	if (sf->requests_left == -1) {
+		return EPOLLOUT;
+	}
+
+	/* The target has read all of the last segment and waits again */
+	if (!sf->rx_length && sf->requests_queued) {
+		loadgen.requests_done += sf->requests_queued;
+		sf->requests_queued = 0;
+	}
+	return EPOLLIN | EPOLLOUT;
 }
 
-int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
-	set_consumable_data(data, size);
+/* Returns the length of the next segment of sf, 0 for EOF and -1 for sockets we do not drive */
+int loadgen_segment(struct socket_file *sf, const unsigned char **data) {
+	if (sf->requests_left == -1) {
+		return -1;
+	}
 
-	test();
+	if (loadgen.websocket && !sf->upgraded) {
+		sf->upgraded = 1;
+		*data = (const unsigned char *) LOADGEN_UPGRADE;
+		return sizeof(LOADGEN_UPGRADE) - 1;
+	}
 
-	if (num_fds) {
-		printf("ERROR! Cannot leave open FDs after test!\n");
+	if (!sf->requests_left) {
+		loadgen.finished++;
+		return 0;
 	}
 
-	return 0;
+	sf->requests_queued = sf->requests_left < loadgen.pipeline ? sf->requests_left : loadgen.pipeline;
+	sf->requests_left -= sf->requests_queued;
+	*data = loadgen.batch;
+	return sf->requests_queued * loadgen.request_length;
 }
 
-#ifdef __cplusplus
+/* The target hanging up finishes a connection early, what it read of it is done */
+void loadgen_close(struct socket_file *sf) {
+	if (sf->requests_left == -1) {
+		return;
+	}
+	if (!sf->rx_length) {
+		loadgen.requests_done += sf->requests_queued;
+	}
+	if (!sf->rx_eof) {
+		loadgen.finished++;
+	}
+}
+
+/* Writes one masked binary frame as a client sends it, returns its length */
+int loadgen_frame(unsigned char *frame, int size) {
+	const unsigned char mask[4] = {0x12, 0x34, 0x56, 0x78};
+	int length = 0;
+
+	frame[length++] = 0x82;
+	if (size < 126) {
+		frame[length++] = 0x80 | size;
+	} else {
+		frame[length++] = 0x80 | 126;
+		frame[length++] = size >> 8;
+		frame[length++] = size & 0xff;
+	}
+	memcpy(frame + length, mask, 4);
+	length += 4;
+
+	for (int i = 0; i < size; i++) {
+		frame[length++] = ('a' + i % 26) ^ mask[i % 4];
+	}
+	return length;
+}
+
+int main(int argc, char **argv) {
+	loadgen.connections = 100;
+	loadgen.requests = 1000;
+	loadgen.frame_size = 64;
+
+	int valid = argc > 1 && (!strcmp(argv[1], "http") || !strcmp(argv[1], "websocket"));
+	loadgen.websocket = valid && !strcmp(argv[1], "websocket");
+	loadgen.pipeline = loadgen.websocket ? 1 : 16;
+
+	for (int i = 2; valid && i < argc; i += 2) {
+		int value = i + 1 < argc ? atoi(argv[i + 1]) : 0;
+		if (!strcmp(argv[i], "-c")) {
+			loadgen.connections = value;
+		} else if (!strcmp(argv[i], "-n")) {
+			loadgen.requests = value;
+		} else if (!strcmp(argv[i], "-p")) {
+			loadgen.pipeline = value;
+		} else if (!strcmp(argv[i], "-s")) {
+			loadgen.frame_size = value;
+		} else {
+			valid = 0;
+		}
+		valid = valid && value > 0;
+	}
+
+	/* Accepted connections and the listener all need an FD */
+	int max_fds = loadgen.connections + 16 > default_max_fds() ? loadgen.connections + 16 : default_max_fds();
+	if (!valid || loadgen.frame_size > 65535 || set_max_fds(max_fds)) {
+		fprintf(stderr, "Usage: %s http|websocket [-c connections] [-n requests per connection] "
+			"[-p requests per segment] [-s frame size]\n", argv[0]);
+		return 1;
+	}
+
+	if (loadgen.websocket) {
+		loadgen.batch = (unsigned char *) malloc((size_t) loadgen.pipeline * (loadgen.frame_size + 8));
+		loadgen.request_length = loadgen_frame(loadgen.batch, loadgen.frame_size);
+	} else {
+		loadgen.batch = (unsigned char *) malloc((size_t) loadgen.pipeline * (sizeof(LOADGEN_GET) - 1));
+		loadgen.request_length = sizeof(LOADGEN_GET) - 1;
+		memcpy(loadgen.batch, LOADGEN_GET, loadgen.request_length);
+	}
+	for (int i = 1; i < loadgen.pipeline; i++) {
+		memcpy(loadgen.batch + i * loadgen.request_length, loadgen.batch, loadgen.request_length);
+	}
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	LLVMFuzzerTestOneInput(NULL, 0);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+	double requests = loadgen.requests_done ? (double) loadgen.requests_done : 1;
+
+	printf("%s: %d connections, %llu of %llu requests in %.1f ms\n", argv[1], loadgen.connections,
+		(unsigned long long) loadgen.requests_done, (unsigned long long) loadgen.connections * loadgen.requests, ns / 1e6);
+	printf("%.0f requests/sec, %.1f ns/request, %.2f syscalls/request\n", requests * 1e9 / ns, ns / requests,
+		loadgen_syscalls / requests);
+	print_read_stats(stdout);
+	print_send_stats(stdout);
+#ifdef CONNECTION_MEMORY
+	print_memory_stats(stdout);
+#endif
+
+	free(loadgen.batch);
+	return 0;
 }
 #endif
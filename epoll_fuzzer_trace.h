@@ -0,0 +1,139 @@
+/* Binary syscall trace format shared by libEpollFuzzer and the trace decoder */
+
+#ifndef EPOLL_FUZZER_TRACE_H
+#define EPOLL_FUZZER_TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* Every mocked syscall (and a few pseudo events) has an id */
+enum trace_syscall {
+	TRACE_INPUT,
+	TRACE_EPOLL_CREATE1,
+	TRACE_EPOLL_CTL,
+	TRACE_EPOLL_WAIT,
+	TRACE_EPOLL_EVENT,
+	TRACE_TEARDOWN,
+	TRACE_READ,
+	TRACE_SEND,
+	TRACE_BIND,
+	TRACE_SETSOCKOPT,
+	TRACE_FCNTL,
+	TRACE_GETADDRINFO,
+	TRACE_GETPEERNAME,
+	TRACE_ACCEPT4,
+	TRACE_LISTEN,
+	TRACE_SOCKET,
+	TRACE_SHUTDOWN,
+	TRACE_TIMERFD_CREATE,
+	TRACE_TIMERFD_SETTIME,
+	TRACE_EVENTFD,
+	TRACE_CLOSE,
+	TRACE_TIMERFD_GETTIME,
+	TRACE_RECEIVE,
+	TRACE_DRAIN,
+	TRACE_WRITE,
+	TRACE_WRITEV,
+	TRACE_SENDMSG,
+	TRACE_MESSAGE,
+	TRACE_IO_URING_SETUP,
+	TRACE_IO_URING_ENTER,
+	TRACE_IO_URING_REGISTER,
+	TRACE_COMPLETION,
+	TRACE_DATAGRAMS,
+	TRACE_RECVMSG,
+	TRACE_RECVMMSG,
+	TRACE_SENDMMSG,
+	TRACE_CONNECT,
+	TRACE_CONNECTED,
+	TRACE_GETSOCKOPT,
+	TRACE_NUM_SYSCALLS
+};
+
+/* Names of the syscall and its two recorded arguments, NULL for unused arguments */
+static const char *trace_names[TRACE_NUM_SYSCALLS][3] = {
+	{"input", "length", NULL},
+	{"epoll_create1", "flags", NULL},
+	{"epoll_ctl", "op", "fd"},
+	{"epoll_wait", "maxevents", "timeout"},
+	{"  event", "events", NULL},
+	{"teardown", NULL, NULL},
+	{"read", "count", NULL},
+	{"send", "len", "flags"},
+	{"bind", NULL, NULL},
+	{"setsockopt", "level", "optname"},
+	{"fcntl", "cmd", NULL},
+	{"getaddrinfo", "family", NULL},
+	{"getpeername", NULL, NULL},
+	{"accept4", NULL, NULL},
+	{"listen", NULL, NULL},
+	{"socket", "domain", "type"},
+	{"shutdown", NULL, NULL},
+	{"timerfd_create", "clockid", "flags"},
+	{"timerfd_settime", "flags", "value_ns"},
+	{"eventfd", NULL, NULL},
+	{"close", NULL, NULL},
+	{"timerfd_gettime", "value_ns", NULL},
+	{"  receive", "length", NULL},
+	{"  drain", "length", NULL},
+	{"write", "count", NULL},
+	{"writev", "length", NULL},
+	{"sendmsg", "length", "flags"},
+	{"  message", "syscalls", "length"},
+	{"io_uring_setup", "entries", "flags"},
+	{"io_uring_enter", "to_submit", "min_complete"},
+	{"io_uring_register", "opcode", "nr_args"},
+	{"  completion", "opcode", "res"},
+	{"  datagrams", "count", "length"},
+	{"recvmsg", "length", "flags"},
+	{"recvmmsg", "vlen", "flags"},
+	{"sendmmsg", "vlen", "flags"},
+	{"connect", "family", NULL},
+	{"  connected", "error", NULL},
+	{"getsockopt", "level", "optname"}
+};
+
+/* One record is written per mocked syscall, 32 bytes each */
+struct trace_record {
+	/* How far into the fuzz data we were when the syscall returned */
+	uint32_t offset;
+	uint16_t syscall;
+	int16_t error;
+	int32_t fd;
+	int32_t ret;
+	int64_t args[2];
+};
+
+/* A dump is this header, then the records oldest first, then the input itself */
+struct trace_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t num_records;
+	uint32_t num_dropped;
+	uint32_t input_length;
+};
+
+#define TRACE_MAGIC "EFTR"
+/* Bumped whenever records or syscall numbers change, so that older dumps are rejected */
+#define TRACE_VERSION 2
+
+static inline void print_trace_record(FILE *out, const struct trace_record *r) {
+	const char **names = trace_names[r->syscall < TRACE_NUM_SYSCALLS ? (int) r->syscall : (int) TRACE_INPUT];
+
+	fprintf(out, "[%6u] %s(", r->offset, names[0]);
+	if (r->syscall != TRACE_INPUT) {
+		fprintf(out, "%d", r->fd);
+	}
+	for (int i = 0; i < 2; i++) {
+		if (names[i + 1]) {
+			fprintf(out, "%s%s=%lld", r->syscall != TRACE_INPUT || i ? ", " : "", names[i + 1], (long long) r->args[i]);
+		}
+	}
+	fprintf(out, ") = %d", r->ret);
+	if (r->error) {
+		fprintf(out, " (errno %d)", r->error);
+	}
+	fprintf(out, "\n");
+}
+
+#endif
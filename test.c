@@ -130,9 +130,8 @@ void test() {
 
 /* Thus function should shutdown the event-loop and let the test fall through */
 void teardown() {
-	/* If we are called twice there's a bug (it potentially could if
-	 * all open sockets cannot be error-closed in one epoll_wait call).
-	 * But we only allow 1k FDs and we have a buffer of 1024 from epoll_wait */
+	/* We are called once per input. Open sockets may not all fit in one epoll_wait call,
+	 * so epoll_wait error-closes them over as many calls as it takes, whatever the FD capacity */
 	if (!listen_socket) {
 		exit(-1);
 	}
@@ -0,0 +1,54 @@
+/* Prints a syscall trace dumped by libEpollFuzzer as a human readable timeline */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "epoll_fuzzer_trace.h"
+
+int main(int argc, char **argv) {
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s epoll_fuzzer_trace.bin\n", argv[0]);
+		return 1;
+	}
+
+	FILE *f = fopen(argv[1], "rb");
+	if (!f) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	struct trace_header header;
+	if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, TRACE_MAGIC, 4) || header.version != TRACE_VERSION) {
+		fprintf(stderr, "%s is not a version %d trace\n", argv[1], TRACE_VERSION);
+		return 1;
+	}
+
+	struct trace_record *records = (struct trace_record *) malloc(header.num_records * sizeof(struct trace_record) + 1);
+	unsigned char *input = (unsigned char *) malloc(header.input_length + 1);
+	if (fread(records, sizeof(struct trace_record), header.num_records, f) != header.num_records ||
+		fread(input, 1, header.input_length, f) != header.input_length) {
+		fprintf(stderr, "%s is truncated\n", argv[1]);
+		return 1;
+	}
+
+	if (header.num_dropped) {
+		printf("(%u older records were overwritten)\n", header.num_dropped);
+	}
+
+	/* Offsets refer to the last input, which is the one stored in the trace */
+	for (unsigned int i = 0; i < header.num_records; i++) {
+		print_trace_record(stdout, &records[i]);
+	}
+
+	printf("Last input was %u bytes:", header.input_length);
+	for (unsigned int i = 0; i < header.input_length; i++) {
+		printf("%s%02x", i % 32 ? " " : "\n", input[i]);
+	}
+	printf("\n");
+
+	free(records);
+	free(input);
+	fclose(f);
+	return 0;
+}